@@ -0,0 +1,584 @@
+/* Allocator benchmarks. Every workload is replayable from its seed and runs in
+ * a forked child per allocator, so peak RSS is measured in isolation. The
+ * allocator is linked in through the interposed build, so libc itself uses it,
+ * and glibc's own malloc stays reachable as __libc_malloc for comparison.
+ * Build and run with
+ *
+ *   gcc -O2 -o bench bench.c malloc_interpose.c -lpthread
+ *   ./bench [-w workload] [-a malloc.c|glibc] [-t threads] [-n scale] [-s seed]
+ *
+ * Deferred coalescing is chosen at build time, so compare it by building a
+ * second binary and running both with the same seed
+ *
+ *   gcc -O2 -DMALLOC_DEFERRED_COALESCE -o bench_dc bench.c malloc_interpose.c -lpthread
+ *   ./bench -a malloc.c -s 1 && ./bench_dc -a malloc.c -s 1
+ *
+ * Each row reports throughput, per operation latency percentiles from a
+ * sample of operations, peak RSS, and fragmentation as peak RSS over the peak
+ * of bytes live in the workload. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "malloc.h"
+
+#define LATENCY_SAMPLE_MASK         15        /* time one operation in 16 */
+#define HISTOGRAM_BUCKETS           (64 + 40 * 16) /* exact below 64 ns, then 16 per power of two */
+#define LIVE_FLUSH_OPS              64        /* thread live byte deltas reach the global count this often */
+#define MAX_THREADS                 64
+#define RING_SIZE                   1024      /* producer to consumer queue length */
+
+/* Allocator under test, called through pointers so every workload runs unchanged on each */
+struct allocator_t {
+    const char*                     name;
+    void*                           (*malloc)(size_t size);
+    void                            (*free)(void* ptr);
+    void*                           (*realloc)(void* ptr, size_t size);
+};
+
+extern void* __libc_malloc(size_t size);
+extern void __libc_free(void* ptr);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static void* our_malloc(size_t size) {
+    return Malloc(size);
+}
+
+static void our_free(void* ptr) {
+    Free(ptr);
+}
+
+static void* our_realloc(void* ptr, size_t size) {
+    return Realloc(ptr, size);
+}
+
+static const struct allocator_t     allocators[] = {
+    { "malloc.c", our_malloc, our_free, our_realloc },
+    { "glibc", __libc_malloc, __libc_free, __libc_realloc },
+};
+
+/* Parameters shared by every thread of a run */
+struct bench_t {
+    const struct allocator_t*       allocator;
+    unsigned int                    threads;
+    uint64_t                        scale;      /* multiplies the operation count of each workload */
+    uint64_t                        seed;
+};
+
+/* Per thread state. Operations and latency are merged into the result at the end */
+struct thread_ctx_t {
+    struct bench_t*                 bench;
+    unsigned int                    index;
+    uint64_t                        rng;
+    uint64_t                        ops;
+    int64_t                         live_delta; /* bytes allocated minus freed since the last flush */
+    uint32_t                        histogram[HISTOGRAM_BUCKETS];
+};
+
+/* What a child sends back to the parent */
+struct result_t {
+    uint64_t                        ops;
+    double                          seconds;
+    uint64_t                        p50;        /* latency percentiles in ns */
+    uint64_t                        p99;
+    uint64_t                        p999;
+    uint64_t                        peak_rss;   /* bytes */
+    uint64_t                        peak_live;  /* bytes */
+};
+
+static int64_t                      live_bytes = 0;
+static int64_t                      peak_live = 0;
+static uint32_t                     histogram[HISTOGRAM_BUCKETS]; /* merged from the threads */
+static uint64_t                     total_ops = 0;
+static pthread_mutex_t              merge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* xorshift64, seeded per thread so runs replay exactly */
+static inline uint64_t next_random(struct thread_ctx_t* ctx) {
+    ctx->rng ^= ctx->rng << 13;
+    ctx->rng ^= ctx->rng >> 7;
+    ctx->rng ^= ctx->rng << 17;
+    return ctx->rng;
+}
+
+/* Set up thread index of thread generation round */
+static void ctx_init(struct thread_ctx_t* ctx, struct bench_t* bench, unsigned int index, unsigned int round) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->bench = bench;
+    ctx->index = index;
+    ctx->rng = (bench->seed + 1) * 0x9e3779b97f4a7c15UL + (index + round * MAX_THREADS) * 0xbf58476d1ce4e5b9UL;
+    next_random(ctx);
+}
+
+static inline unsigned int bucket_of(uint64_t ns) {
+    if (ns < 64) {
+        return ns;
+    }
+    unsigned int exponent = 63 - __builtin_clzll(ns);
+    if (exponent > 45) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    return 64 + (exponent - 6) * 16 + ((ns >> (exponent - 4)) & 15);
+}
+
+/* Lower bound of the latencies in bucket */
+static inline uint64_t bucket_value(unsigned int bucket) {
+    if (bucket < 64) {
+        return bucket;
+    }
+    unsigned int exponent = (bucket - 64) / 16 + 6;
+    return (1UL << exponent) | ((uint64_t)((bucket - 64) % 16) << (exponent - 4));
+}
+
+/* Publish the live byte delta of ctx and raise the global peak */
+static void live_flush(struct thread_ctx_t* ctx) {
+    int64_t live = __atomic_add_fetch(&live_bytes, ctx->live_delta, __ATOMIC_RELAXED);
+    ctx->live_delta = 0;
+    int64_t peak = __atomic_load_n(&peak_live, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&peak_live, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static inline void count_op(struct thread_ctx_t* ctx, uint64_t start) {
+    if (start != 0) {
+        ctx->histogram[bucket_of(now_ns() - start)]++;
+    }
+    if ((++ctx->ops % LIVE_FLUSH_OPS) == 0) {
+        live_flush(ctx);
+    }
+}
+
+static inline uint64_t sample_start(struct thread_ctx_t* ctx) {
+    return (ctx->ops & LATENCY_SAMPLE_MASK) == 0 ? now_ns() : 0;
+}
+
+/* Write one byte per page so the block counts toward RSS, outside the timed section */
+static inline void touch(char* ptr, uint64_t size) {
+    for (uint64_t i = 0; i < size; i += 4096) {
+        ptr[i] = (char)i;
+    }
+    if (size != 0) {
+        ptr[size - 1] = 1;
+    }
+}
+
+static void* bench_malloc(struct thread_ctx_t* ctx, uint64_t size) {
+    uint64_t start = sample_start(ctx);
+    char* ptr = ctx->bench->allocator->malloc(size);
+    count_op(ctx, start);
+    if (ptr == NULL) {
+        fprintf(stderr, "%s: out of memory for %lu bytes\n", ctx->bench->allocator->name, size);
+        _exit(1);
+    }
+    ctx->live_delta += size;
+    touch(ptr, size);
+    return ptr;
+}
+
+static void bench_free(struct thread_ctx_t* ctx, void* ptr, uint64_t size) {
+    uint64_t start = sample_start(ctx);
+    ctx->bench->allocator->free(ptr);
+    count_op(ctx, start);
+    ctx->live_delta -= size;
+}
+
+static void* bench_realloc(struct thread_ctx_t* ctx, void* ptr, uint64_t old_size, uint64_t size) {
+    uint64_t start = sample_start(ctx);
+    char* new_ptr = ctx->bench->allocator->realloc(ptr, size);
+    count_op(ctx, start);
+    if (new_ptr == NULL) {
+        fprintf(stderr, "%s: out of memory for %lu bytes\n", ctx->bench->allocator->name, size);
+        _exit(1);
+    }
+    ctx->live_delta += size - old_size;
+    if (size > old_size) {
+        touch(new_ptr + old_size, size - old_size);
+    }
+    return new_ptr;
+}
+
+/* Zeroed bookkeeping memory from the allocator under test, untimed and not counted as live.
+ * Taking it from the other allocator would let two heaps compete for the program break */
+static void* scratch_alloc(struct thread_ctx_t* ctx, uint64_t size) {
+    void* ptr = ctx->bench->allocator->malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "%s: out of memory for %lu bytes\n", ctx->bench->allocator->name, size);
+        _exit(1);
+    }
+    return memset(ptr, 0, size);
+}
+
+static void ctx_merge(struct thread_ctx_t* ctx) {
+    live_flush(ctx);
+    pthread_mutex_lock(&merge_lock);
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        histogram[i] += ctx->histogram[i];
+    }
+    total_ops += ctx->ops;
+    pthread_mutex_unlock(&merge_lock);
+}
+
+/* Sizes uniform over 16 to 4096 bytes */
+static inline uint64_t uniform_size(struct thread_ctx_t* ctx) {
+    return 16 + next_random(ctx) % 4081;
+}
+
+/* Sizes whose power of two halves in probability at each step, from 16 bytes up to 1 MiB */
+static inline uint64_t power_law_size(struct thread_ctx_t* ctx) {
+    uint64_t random = next_random(ctx);
+    unsigned int exponent = 4 + __builtin_ctzll(random | (1UL << 15));
+    return (1UL << exponent) + (random >> 32) % (1UL << exponent);
+}
+
+/* Random replacement over a working set of slots */
+static void churn(struct thread_ctx_t* ctx, uint64_t ops, unsigned int slots, uint64_t (*size_of)(struct thread_ctx_t*)) {
+    void** ptrs = scratch_alloc(ctx, slots * sizeof(void*));
+    uint64_t* sizes = scratch_alloc(ctx, slots * sizeof(uint64_t));
+    for (uint64_t i = 0; i < ops; i++) {
+        unsigned int slot = next_random(ctx) % slots;
+        if (ptrs[slot] != NULL) {
+            bench_free(ctx, ptrs[slot], sizes[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            sizes[slot] = size_of(ctx);
+            ptrs[slot] = bench_malloc(ctx, sizes[slot]);
+        }
+    }
+    for (unsigned int slot = 0; slot < slots; slot++) {
+        if (ptrs[slot] != NULL) {
+            bench_free(ctx, ptrs[slot], sizes[slot]);
+        }
+    }
+    ctx->bench->allocator->free(ptrs);
+    ctx->bench->allocator->free(sizes);
+}
+
+static void* uniform_thread(void* arg) {
+    struct thread_ctx_t* ctx = arg;
+    churn(ctx, 2000000 * ctx->bench->scale / ctx->bench->threads, 4096, uniform_size);
+    ctx_merge(ctx);
+    return NULL;
+}
+
+static void* power_law_thread(void* arg) {
+    struct thread_ctx_t* ctx = arg;
+    churn(ctx, 500000 * ctx->bench->scale / ctx->bench->threads, 2048, power_law_size);
+    ctx_merge(ctx);
+    return NULL;
+}
+
+/* Single producer single consumer ring. Sizes travel with the blocks */
+struct ring_t {
+    void*                           ptrs[RING_SIZE];
+    uint64_t                        sizes[RING_SIZE];
+    uint64_t                        head __attribute__((aligned(64))); /* next slot the producer fills */
+    uint64_t                        tail __attribute__((aligned(64))); /* next slot the consumer drains */
+    char                            done;
+};
+
+static struct ring_t                rings[MAX_THREADS / 2];
+
+static void* producer_thread(void* arg) {
+    struct thread_ctx_t* ctx = arg;
+    struct ring_t* ring = &rings[ctx->index / 2];
+    uint64_t ops = 1000000 * ctx->bench->scale / ctx->bench->threads;
+    for (uint64_t i = 0; i < ops; i++) {
+        uint64_t size = 16 + next_random(ctx) % 497;
+        void* ptr = bench_malloc(ctx, size);
+        while (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            sched_yield();
+        }
+        uint64_t head = ring->head;
+        ring->ptrs[head % RING_SIZE] = ptr;
+        ring->sizes[head % RING_SIZE] = size;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+    ctx_merge(ctx);
+    return NULL;
+}
+
+static void* consumer_thread(void* arg) {
+    struct thread_ctx_t* ctx = arg;
+    struct ring_t* ring = &rings[ctx->index / 2];
+    for (;;) {
+        uint64_t tail = ring->tail;
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+            if (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        bench_free(ctx, ring->ptrs[tail % RING_SIZE], ring->sizes[tail % RING_SIZE]);
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    ctx_merge(ctx);
+    return NULL;
+}
+
+static void* producer_consumer_thread(void* arg) {
+    struct thread_ctx_t* ctx = arg;
+    return ctx->index % 2 == 0 ? producer_thread(arg) : consumer_thread(arg);
+}
+
+/* Larson: each thread replaces random blocks of a slot array, then hands the
+ * array to a fresh thread, so blocks are freed by threads that did not allocate them */
+#define LARSON_SLOTS                1000
+#define LARSON_ROUNDS               8
+
+struct larson_set_t {
+    void*                           ptrs[LARSON_SLOTS];
+    uint64_t                        sizes[LARSON_SLOTS];
+};
+
+static struct larson_set_t          larson_sets[MAX_THREADS];
+
+static void* larson_thread(void* arg) {
+    struct thread_ctx_t* ctx = arg;
+    struct larson_set_t* set = &larson_sets[ctx->index % MAX_THREADS];
+    uint64_t ops = 2000000 * ctx->bench->scale / ctx->bench->threads / LARSON_ROUNDS;
+    for (uint64_t i = 0; i < ops; i++) {
+        unsigned int slot = next_random(ctx) % LARSON_SLOTS;
+        if (set->ptrs[slot] != NULL) {
+            bench_free(ctx, set->ptrs[slot], set->sizes[slot]);
+        }
+        set->sizes[slot] = 16 + next_random(ctx) % 497;
+        set->ptrs[slot] = bench_malloc(ctx, set->sizes[slot]);
+    }
+    ctx_merge(ctx);
+    return NULL;
+}
+
+/* Buffers grown by realloc in random steps up to 1 MiB, then freed */
+static void* realloc_thread(void* arg) {
+    struct thread_ctx_t* ctx = arg;
+    uint64_t buffers = 20000 * ctx->bench->scale / ctx->bench->threads;
+    for (uint64_t i = 0; i < buffers; i++) {
+        uint64_t limit = 64UL << (next_random(ctx) % 15);
+        uint64_t size = 16;
+        void* ptr = bench_malloc(ctx, size);
+        while (size < limit) {
+            uint64_t grown = size + 16 + next_random(ctx) % size;
+            ptr = bench_realloc(ctx, ptr, size, grown);
+            size = grown;
+        }
+        bench_free(ctx, ptr, size);
+    }
+    ctx_merge(ctx);
+    return NULL;
+}
+
+/* Fragmentation soak: phases of many small short lived blocks interleaved
+ * with long lived ones, after which most small blocks die and larger ones
+ * are requested, which can only reuse the holes if they were coalesced */
+static void* soak_thread(void* arg) {
+    struct thread_ctx_t* ctx = arg;
+    unsigned int slots = 1 << 16;
+    void** ptrs = scratch_alloc(ctx, slots * sizeof(void*));
+    uint64_t* sizes = scratch_alloc(ctx, slots * sizeof(uint64_t));
+    uint64_t phases = 40 * ctx->bench->scale;
+    for (uint64_t phase = 0; phase < phases; phase++) {
+        uint64_t small = phase % 2 == 0;
+        for (unsigned int slot = 0; slot < slots; slot++) {
+            if (ptrs[slot] != NULL && next_random(ctx) % 8 != 0) {
+                bench_free(ctx, ptrs[slot], sizes[slot]);
+                ptrs[slot] = NULL;
+            }
+            if (ptrs[slot] == NULL && next_random(ctx) % 2 == 0) {
+                sizes[slot] = small ? 16 + next_random(ctx) % 240 : 256 + next_random(ctx) % 3840;
+                ptrs[slot] = bench_malloc(ctx, sizes[slot]);
+            }
+        }
+    }
+    for (unsigned int slot = 0; slot < slots; slot++) {
+        if (ptrs[slot] != NULL) {
+            bench_free(ctx, ptrs[slot], sizes[slot]);
+        }
+    }
+    ctx->bench->allocator->free(ptrs);
+    ctx->bench->allocator->free(sizes);
+    ctx_merge(ctx);
+    return NULL;
+}
+
+struct workload_t {
+    const char*                     name;
+    void*                           (*thread)(void* ctx);
+    unsigned int                    rounds;     /* thread generations, each starting once the last has exited */
+    char                            paired;     /* needs an even number of threads */
+};
+
+static const struct workload_t      workloads[] = {
+    { "uniform", uniform_thread, 1, 0 },
+    { "power-law", power_law_thread, 1, 0 },
+    { "prod-cons", producer_consumer_thread, 1, 1 },
+    { "larson", larson_thread, LARSON_ROUNDS, 0 },
+    { "realloc", realloc_thread, 1, 0 },
+    { "soak", soak_thread, 1, 0 },
+};
+
+/* Run workload in this process and fill result */
+static void run_workload(const struct workload_t* workload, struct bench_t* bench, struct result_t* result) {
+    static struct thread_ctx_t ctxs[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    uint64_t start = now_ns();
+    for (unsigned int round = 0; round < workload->rounds; round++) {
+        for (unsigned int i = 0; i < bench->threads; i++) {
+            ctx_init(&ctxs[i], bench, i, round);
+            pthread_create(&threads[i], NULL, workload->thread, &ctxs[i]);
+        }
+        for (unsigned int i = 0; i < bench->threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        if (workload->thread == larson_thread) {
+            // Hand every slot array to the next thread of the following round
+            struct larson_set_t first = larson_sets[0];
+            memmove(&larson_sets[0], &larson_sets[1], (bench->threads - 1) * sizeof(struct larson_set_t));
+            larson_sets[bench->threads - 1] = first;
+        }
+    }
+    if (workload->thread == larson_thread) {
+        struct thread_ctx_t* ctx = &ctxs[0];
+        ctx_init(ctx, bench, 0, workload->rounds);
+        for (unsigned int i = 0; i < bench->threads; i++) {
+            for (unsigned int slot = 0; slot < LARSON_SLOTS; slot++) {
+                if (larson_sets[i].ptrs[slot] != NULL) {
+                    bench_free(ctx, larson_sets[i].ptrs[slot], larson_sets[i].sizes[slot]);
+                }
+            }
+        }
+        ctx_merge(ctx);
+    }
+    result->seconds = (now_ns() - start) / 1e9;
+    result->ops = total_ops;
+    uint64_t sampled = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        sampled += histogram[i];
+    }
+    uint64_t seen = 0;
+    uint64_t* targets[] = { &result->p50, &result->p99, &result->p999 };
+    double fractions[] = { 0.5, 0.99, 0.999 };
+    unsigned int next = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS && next < 3; i++) {
+        seen += histogram[i];
+        while (next < 3 && seen > fractions[next] * sampled) {
+            *targets[next++] = bucket_value(i);
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result->peak_rss = usage.ru_maxrss * 1024UL;
+    result->peak_live = peak_live;
+}
+
+/* Fork a child to run workload with allocator, reading its result through a pipe. Returns 0 on success */
+static int run_forked(const struct workload_t* workload, struct bench_t* bench, struct result_t* result) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        run_workload(workload, bench, result);
+        _exit(write(fds[1], result, sizeof(*result)) == sizeof(*result) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t got = pid < 0 ? -1 : read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+    int status = 0;
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+    }
+    return got == sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "usage: %s [-w workload] [-a allocator] [-t threads] [-n scale] [-s seed]\nworkloads:", program);
+    for (unsigned int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        fprintf(stderr, " %s", workloads[i].name);
+    }
+    fprintf(stderr, "\nallocators:");
+    for (unsigned int i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        fprintf(stderr, " %s", allocators[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char** argv) {
+    const char* workload_name = NULL;
+    const char* allocator_name = NULL;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threads = cpus < 2 ? 2 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+    uint64_t scale = 1;
+    uint64_t seed = 1;
+    for (int option; (option = getopt(argc, argv, "w:a:t:n:s:h")) != -1; ) {
+        switch (option) {
+        case 'w':
+            workload_name = optarg;
+            break;
+        case 'a':
+            allocator_name = optarg;
+            break;
+        case 't':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            scale = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 2;
+        }
+    }
+    if (threads < 1 || threads > MAX_THREADS || scale < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    printf("%-10s %-9s %7s %10s %8s %8s %8s %10s %6s\n",
+           "workload", "allocator", "threads", "Mops/s", "p50 ns", "p99 ns", "p999 ns", "peak RSS", "frag");
+    int failed = 0;
+    for (unsigned int w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        const struct workload_t* workload = &workloads[w];
+        if (workload_name != NULL && strcmp(workload_name, workload->name) != 0) {
+            continue;
+        }
+        for (unsigned int a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+            if (allocator_name != NULL && strcmp(allocator_name, allocators[a].name) != 0) {
+                continue;
+            }
+            struct bench_t bench = { &allocators[a], threads, scale, seed };
+            if (workload->paired && bench.threads % 2 != 0) {
+                bench.threads++;
+            }
+            struct result_t result;
+            if (run_forked(workload, &bench, &result) != 0) {
+                printf("%-10s %-9s failed\n", workload->name, allocators[a].name);
+                failed = 1;
+                continue;
+            }
+            printf("%-10s %-9s %7u %10.2f %8lu %8lu %8lu %9.1fM %6.2f\n",
+                   workload->name, allocators[a].name, bench.threads, result.ops / result.seconds / 1e6,
+                   result.p50, result.p99, result.p999, result.peak_rss / 1048576.0,
+                   result.peak_live == 0 ? 0 : (double)result.peak_rss / result.peak_live);
+        }
+    }
+    return failed;
+}
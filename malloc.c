@@ -1,5 +1,26 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef MALLOC_PROFILE
+#include <execinfo.h>
+#endif
+#ifdef MALLOC_TRACE
+#include <sys/file.h>
+#endif
+#ifdef MALLOC_HARDENED
+#include <sys/auxv.h>
+#endif
 #include "malloc.h"
 struct block_header_t {
     uint64_t                        size; /* size of usable data block */
@@ -7,15 +28,190 @@ struct block_header_t {
     struct block_header_t*          prev; /* pointer to previous block. Only used when block is free*/
 };
 
-/* Footer used to merge with previous block */
+/* Large free blocks are nodes of a red-black tree ordered by size, then address.
+ * The node overlays the block, so it costs no space beyond the block's data */
+struct tree_node_t {
+    uint64_t                        size; /* size of usable data block */
+    struct tree_node_t*             left;
+    struct tree_node_t*             right;
+    struct tree_node_t*             parent;
+    uint64_t                        red;  /* 1 if node is red, 0 if black */
+    uint32_t                        freed_at; /* decay_clock when the block was last freed */
+    uint32_t                        decay_state; /* DECAY_DIRTY, DECAY_MUZZY or DECAY_RELEASED */
+};
+
+/* Footer used to merge with previous block. Only free blocks have one, in their last 8 bytes */
 struct block_footer_t {
     uint64_t                        size; /* size of usable data block */
 };
 
+/* Tunables below are wrapped in #ifndef so a build can override them with -D.
+ * Those with a runtime counterpart can also be set through MALLOC_CONF, a list
+ * of name:value pairs separated by commas, read once by init(). */
+#ifndef INIIAL_HEAP_SIZE
 #define INIIAL_HEAP_SIZE            1024
-#define ALLOC_SIZE                  1024
-#define MINIMUM_ALLOC_SIZE          16
-#define MINIMUM_BLOCK_SIZE          (sizeof(uint64_t) + MINIMUM_ALLOC_SIZE + sizeof(struct block_footer_t))
+#endif
+#ifndef ALLOC_SIZE
+#define ALLOC_SIZE                  1024          /* smallest heap growth */
+#endif
+#ifndef HEAP_GROWTH_SHIFT
+#define HEAP_GROWTH_SHIFT           3             /* heap grows by at least 1/8 of its size */
+#endif
+#ifndef MAX_GROWTH_CHUNK
+#define MAX_GROWTH_CHUNK            (8UL << 20)   /* cap on the geometric growth chunk */
+#endif
+#define PAGE_SIZE                   4096UL
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD              (128UL << 10) /* default size served by its own mapping */
+#endif
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD              (128UL << 10) /* default free block size released to the system */
+#endif
+#ifndef TRIM_PAD
+#define TRIM_PAD                    (2UL << 20)   /* free tail Free leaves in place, so growing back needs no syscall */
+#endif
+#define MAX_ALLOC_SIZE              (UINT64_MAX >> 1)
+#define MMAPPED_BIT                 2             /* set in size of blocks served by mmap */
+#define PREV_FREE_BIT               4             /* set in size of blocks whose previous neighbor is free */
+#define MINIMUM_ALLOC_SIZE          24            /* room for next, prev and the footer once freed */
+#define MALLOC_ALIGNMENT            16            /* default alignment of returned data, for SSE/AVX types */
+#define MINIMUM_BLOCK_SIZE          (sizeof(uint64_t) + MINIMUM_ALLOC_SIZE)
+#define BLOCK_OVERHEAD              sizeof(uint64_t) /* used blocks carry only their header */
+#define SENTINEL_SIZE               sizeof(uint64_t) /* room kept past the last block for the header closing its segment */
+
+/* Free blocks below TREE_MIN_SIZE are kept in segregated bins. Below EXACT_BIN_LIMIT
+ * there is one bin per 8 byte size, above it each power of two is split into
+ * BIN_SUBDIVISIONS bins. Larger free blocks go to a size ordered tree. */
+#define EXACT_BIN_LIMIT             256
+#define EXACT_BINS                  (EXACT_BIN_LIMIT >> 3)
+#define BIN_SUBDIVISION_BITS        2
+#define TREE_MIN_SIZE               1024
+#define NUM_BINS                    (EXACT_BINS + (2 << BIN_SUBDIVISION_BITS)) /* bins up to TREE_MIN_SIZE */
+
+/* With MALLOC_DEFERRED_COALESCE defined, freed heap blocks below FASTBIN_MAX_SIZE
+ * wait in per arena LIFO fastbins, one per size, without being coalesced. They
+ * are merged back in one batch when a request finds no free block, or once
+ * FASTBIN_CONSOLIDATE_COUNT of them are waiting. */
+#define FASTBIN_MAX_SIZE            1024
+#define FASTBINS                    (FASTBIN_MAX_SIZE >> 4)
+#define FASTBIN_CONSOLIDATE_COUNT   256
+
+/* With a decay time set through Mallopt or MALLOC_CONF, Free no longer trims or
+ * purges large free blocks itself. A background thread looks at every arena
+ * DECAY_STEPS times per decay time instead. A tree block free for half of it
+ * gets MADV_FREE, so the kernel may take its pages back when short of memory,
+ * and once the whole decay time has passed, MADV_DONTNEED. A free tail that
+ * old is trimmed. A decay time of 0 keeps all of this in Free. */
+#ifndef DECAY_TIME
+#define DECAY_TIME                  0             /* default decay time in ms */
+#endif
+#define DECAY_STEPS                 8
+#define DECAY_MIN_INTERVAL          10            /* ms between passes of the decay thread, at least */
+#define DECAY_DIRTY                 0             /* pages may be resident */
+#define DECAY_MUZZY                 1             /* pages given MADV_FREE */
+#define DECAY_RELEASED              2             /* pages given MADV_DONTNEED */
+#ifndef MADV_FREE
+#define MADV_FREE                   8
+#endif
+
+/* With MALLOC_HARDENED defined, Free, Realloc and FreeBatch check the header of
+ * every heap block and the CANARY_SIZE word kept after its data, free list
+ * unlinks check the footer and both neighbors, and a freed slab slot is marked
+ * in its second word so a double free is caught. Every link stored in freed
+ * memory is mangled, see PROTECT_LINK. All checks touch only the block and its
+ * neighbors. */
+#ifdef MALLOC_HARDENED
+#define CANARY_SIZE                 sizeof(uint64_t)
+#else
+#define CANARY_SIZE                 0
+#endif
+
+/* Requests up to SLAB_MAX_SIZE are served from slab runs: SLAB_RUN_SIZE aligned
+ * chunks of one reserved region, carved into equal slots without boundary tags.
+ * SLAB_CLASS_LIST gives the slot sizes, smallest first. Each is a multiple of
+ * 16, and only the last holds SLAB_MAX_SIZE, which is at most SLAB_LOOKUP_MAX. */
+#ifndef SLAB_CLASS_LIST
+#define SLAB_CLASS_LIST(X, arg)     X(16, arg) X(32, arg) X(48, arg) X(64, arg) X(80, arg) X(96, arg) \
+                                    X(112, arg) X(128, arg) X(160, arg) X(192, arg) X(224, arg) X(256, arg)
+#define SLAB_MAX_SIZE               256
+#endif
+#define SLAB_LOOKUP_MAX             1024
+#define SLAB_RUN_SIZE               (64UL << 10)
+#define SLAB_REGION_SIZE            (4UL << 30)
+
+/* Helpers that expand SLAB_CLASS_LIST into the class count and the lookup table */
+#define SLAB_CLASS_COUNT(size, arg) + 1
+#define SLAB_CLASS_SIZE(size, arg)  size,
+#define SLAB_CLASS_BELOW(size, bytes) + ((size) < (bytes))
+#define SLAB_CLASS_FOR(bytes)       (0 SLAB_CLASS_LIST(SLAB_CLASS_BELOW, bytes)) /* smallest class holding bytes */
+#define SLAB_CLASSES                (0 SLAB_CLASS_LIST(SLAB_CLASS_COUNT, 0))
+#define SLAB_LOOKUP_4(i)            SLAB_CLASS_FOR((i) << 4), SLAB_CLASS_FOR((i + 1) << 4), \
+                                    SLAB_CLASS_FOR((i + 2) << 4), SLAB_CLASS_FOR((i + 3) << 4)
+#define SLAB_LOOKUP_16(i)           SLAB_LOOKUP_4(i), SLAB_LOOKUP_4(i + 4), SLAB_LOOKUP_4(i + 8), SLAB_LOOKUP_4(i + 12)
+#define SLAB_LOOKUP_64(i)           SLAB_LOOKUP_16(i), SLAB_LOOKUP_16(i + 16), SLAB_LOOKUP_16(i + 32), SLAB_LOOKUP_16(i + 48)
+
+/* Each thread caches up to TCACHE_MAX_COUNT freed slots per slab class, and
+ * refills an empty bin with TCACHE_FILL_COUNT slots per trip to the arena.
+ * Both are defaults for tcache_max_count and tcache_fill_count. */
+#define TCACHE_BINS                 SLAB_CLASSES
+#ifndef TCACHE_MAX_COUNT
+#define TCACHE_MAX_COUNT            32
+#endif
+#ifndef TCACHE_FILL_COUNT
+#define TCACHE_FILL_COUNT           8
+#endif
+
+/* Regions bump allocate out of REGION_CHUNK_SIZE mappings, which are kept on a
+ * freelist when a region is reset or destroyed. Requests above
+ * REGION_LARGE_SIZE get a mapping of their own instead. */
+#define REGION_CHUNK_SIZE           (64UL << 10)
+#define REGION_LARGE_SIZE           (REGION_CHUNK_SIZE >> 2)
+
+/* With MALLOC_PROFILE defined, about one allocation per PROFILE_INTERVAL bytes
+ * is sampled: its call stack is recorded and kept until the block is freed.
+ * Live samples are hashed by address, and a counting filter of
+ * PROFILE_FILTER_SIZE entries lets Free skip the hash for unsampled blocks. */
+#define PROFILE_INTERVAL            (512UL << 10)
+#define PROFILE_MAX_DEPTH           32
+#define PROFILE_HASH_SIZE           4096
+#define PROFILE_FILTER_SIZE         65536
+#define PROFILE_POOL_SIZE           (64UL << 10) /* samples are carved from mappings of this size */
+
+/* With MALLOC_TRACE defined and MALLOC_TRACE_FILE set in the environment, or
+ * after MallocTraceStart, every call is logged as a malloc_trace_record. Each
+ * thread fills a buffer of TRACE_BUFFER_RECORDS, which is copied into the
+ * trace file through a TRACE_WINDOW_SIZE mapping that slides along the file.
+ * Use %p in the file name to trace every process started with the variable. */
+#define TRACE_BUFFER_RECORDS        4096
+#define TRACE_WINDOW_SIZE           (16UL << 20)
+
+/* Threads are spread round robin over up to MAX_ARENAS arenas, one per CPU.
+ * Arenas other than the sbrk one live in ARENA_HEAP_SIZE reservations aligned
+ * to their size, so the owner of a block is found by masking its address. */
+#define MAX_ARENAS                  64
+#define ARENA_HEAP_SIZE             (64UL << 20)
+
+/* With hugepages set through Mallopt or MALLOC_CONF, an arena whose heap reaches
+ * HUGE_ARENA_SIZE is advised for transparent huge pages and from then on grows
+ * and trims in whole HUGE_PAGE_SIZE pages, so none is split. In hugetlb mode
+ * its growth is mapped from the hugetlbfs pool while the pool lasts. The main
+ * arena then leaves sbrk for a MAIN_HEAP_RESERVE range aligned to a huge page. */
+#define HUGE_PAGE_SIZE              (2UL << 20)
+#ifndef HUGE_ARENA_SIZE
+#define HUGE_ARENA_SIZE             (8UL << 20)
+#endif
+#define MAIN_HEAP_RESERVE           (64UL << 30)
+
+/* With more than one NUMA node online, the arena slots after the unbound main
+ * arena are split evenly between the nodes. Each arena's reservation is bound
+ * to its node and threads take an arena of the node they run on. */
+#define MAX_NUMA_NODES              32
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED              1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE                2
+#endif
 
 /* returns 1 if block is free, 0 otherwise */
 static inline char is_free(struct block_header_t* block) {
@@ -34,27 +230,753 @@ static inline void set_used(void* block) {
     m_block->size &= -2;
 }
 
-/* returns size of block */
+/* returns 1 if the block before this one in the heap is free, 0 otherwise */
+static inline char is_prev_free(struct block_header_t* block) {
+    return ((block->size) & PREV_FREE_BIT) != 0;
+}
+
+/* returns 1 if block has its own mapping, 0 otherwise */
+static inline char is_mmapped(struct block_header_t* block) {
+    return ((block->size) & MMAPPED_BIT) != 0;
+}
+
+/* returns size of block. The low 3 bits of size hold flags */
 static inline uint64_t get_size(void* block) {
     struct block_header_t * m_block = (struct block_header_t*) block;
-    return m_block->size & -2;
+    return m_block->size & -8;
+}
+
+/* An independent heap with its own free bins and lock */
+struct arena_t {
+    char*                           heap;       /* starting address of heap*/
+    char*                           heap_end;   /* end address of heap */
+    char*                           heap_max;   /* end of reserved address range, NULL for the sbrk heap */
+    char*                           clean;      /* memory from here to heap_end has never been written */
+    struct block_header_t*          last;       /* last block allocated */
+    struct block_header_t*          first;      /* first block allocated */
+    struct heap_info_t*             segment;    /* info of the current segment, NULL for the main arena's first */
+    struct block_header_t*          bins[NUM_BINS]; /* free lists segregated by size */
+    uint64_t                        bin_map;    /* bit i is set if bins[i] is not empty */
+    struct tree_node_t*             tree;       /* root of the tree of large free blocks */
+#ifdef MALLOC_DEFERRED_COALESCE
+    struct block_header_t*          fastbins[FASTBINS]; /* freed blocks not yet coalesced, chained by next */
+    uint32_t                        fastbin_count; /* number of blocks in fastbins */
+#endif
+    struct slab_run_t*              slab_runs[SLAB_CLASSES]; /* runs with free slots, per class */
+    uint64_t                        sbrk_calls; /* heap growth syscalls, sbrk or mprotect */
+    int                             huge;       /* MALLOC_HUGEPAGES_* mode once the heap is dense, 0 before */
+    int                             node;       /* NUMA node the reservation is bound to, -1 for none */
+    pthread_mutex_t                 lock;       /* protects all of the above */
+    void*                           remote_free __attribute__((aligned(64))); /* data of blocks freed by
+                                                   other threads, chained through their first word */
+    uint32_t                        threads;    /* threads allocating from the arena, which poll remote_free */
+} __attribute__((aligned(64)));
+
+/* Placed at the start of every slab run */
+struct slab_run_t {
+    struct arena_t*                 arena;      /* arena owning this run */
+    struct slab_run_t*              next;       /* next run of the same class with free slots */
+    struct slab_run_t*              prev;       /* previous run of the same class with free slots */
+    void*                           free_slots; /* freed slots, chained through their first word */
+    uint32_t                        slot_size;  /* size of every slot */
+    uint16_t                        class_index;
+    uint16_t                        nslots;     /* number of slots in run */
+    uint16_t                        nfree;      /* number of slots not handed out */
+    uint16_t                        bump;       /* slots from here on have never been handed out */
+    uint32_t                        freed_at;   /* decay_clock when the run emptied, while on dirty_runs */
+};
+
+#define SLAB_RUN_HEADER_SIZE        ((sizeof(struct slab_run_t) + 15) & -16)
+
+/* Placed at the start of every mmap'd heap segment. An arena's segments are
+ * chained from the current one back to its first */
+struct heap_info_t {
+    struct arena_t*                 arena;      /* arena owning this heap */
+    struct heap_info_t*             prev;       /* info of the previous segment, NULL if it has none */
+    char*                           prev_heap;  /* bounds of the previous segment, NULL if there is none */
+    char*                           prev_heap_end;
+};
+
+static struct arena_t               main_arena = {
+    .heap =                         (char*)-1,
+    .heap_end =                     (char*)-1,
+    .node =                         -1,
+    .lock =                         PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct arena_t*              arenas[MAX_ARENAS] = { &main_arena };
+static char*                        main_heap =    NULL;  /* the main arena's first segment, which has no heap_info */
+static char*                        main_heap_end = NULL;
+static unsigned int                 narenas =      0;     /* number of arenas to spread threads over */
+static unsigned int                 next_arena =   0;     /* round robin counter */
+static pthread_mutex_t              arenas_lock =  PTHREAD_MUTEX_INITIALIZER; /* serializes arena creation */
+static pthread_once_t               init_once =    PTHREAD_ONCE_INIT;
+static __thread struct arena_t*     thread_arena = NULL;  /* arena this thread allocates from */
+static pthread_key_t                arena_key;            /* detaches an exiting thread from its arena */
+static pthread_once_t               arena_key_once = PTHREAD_ONCE_INIT;
+static unsigned int                 numa_nodes =   1;     /* NUMA nodes, set by init */
+static __thread int                 thread_node =  0;     /* node this thread ran on when it took its arena */
+static uint64_t                     mmap_threshold = MMAP_THRESHOLD; /* requests this large get their own mapping */
+static uint64_t                     trim_threshold = TRIM_THRESHOLD; /* free blocks this large are given back */
+static int                          hugepages =    MALLOC_HUGEPAGES_OFF; /* mode taken by arenas as they grow dense */
+static uint64_t                     decay_time =   DECAY_TIME; /* ms a large free block ages before it is purged, 0 purges in Free */
+static uint32_t                     decay_clock =  0;     /* ms, advanced by the decay thread and stamped on freed tree blocks and empty runs */
+static int                          decay_running = 0;    /* 1 once the decay thread is started */
+static pthread_mutex_t              decay_lock =   PTHREAD_MUTEX_INITIALIZER; /* the decay thread waits on decay_cond under it */
+static pthread_cond_t               decay_cond =   PTHREAD_COND_INITIALIZER;  /* signaled when decay_time changes */
+static pthread_once_t               decay_atfork_once = PTHREAD_ONCE_INIT;
+
+static uint32_t                     tcache_max_count = TCACHE_MAX_COUNT; /* slots cached per class */
+static uint32_t                     tcache_fill_count = TCACHE_FILL_COUNT; /* slots taken per refill */
+
+_Static_assert(SLAB_CLASS_FOR(SLAB_MAX_SIZE) == SLAB_CLASSES - 1 && SLAB_MAX_SIZE <= SLAB_LOOKUP_MAX,
+               "only the last of SLAB_CLASS_LIST may hold SLAB_MAX_SIZE, at most SLAB_LOOKUP_MAX");
+
+static const uint32_t               slab_class_sizes[SLAB_CLASSES] = {
+    SLAB_CLASS_LIST(SLAB_CLASS_SIZE, 0)
+};
+
+/* slab class for a request, indexed by (size + 15) >> 4. Entries past
+ * SLAB_MAX_SIZE are never read */
+static const uint8_t                slab_class_of[(SLAB_LOOKUP_MAX >> 4) + 1] = {
+    SLAB_LOOKUP_64(0), SLAB_CLASS_FOR(SLAB_LOOKUP_MAX)
+};
+
+static char*                        slab_region =     NULL; /* start of address range reserved for runs */
+static char*                        slab_region_end = NULL; /* end of reserved range */
+static char*                        slab_next =       NULL; /* first run never handed out */
+static struct slab_run_t*           free_runs =       NULL; /* empty runs ready for reuse, chained by next */
+static struct slab_run_t*           dirty_runs =      NULL; /* empty runs whose pages wait for the decay thread, newest first */
+static pthread_mutex_t              slab_lock =       PTHREAD_MUTEX_INITIALIZER; /* protects the five above */
+
+/* Placed at the start of every region chunk */
+struct region_chunk_t {
+    struct region_chunk_t*          next;       /* next chunk of the region, or of the freelist */
+    uint64_t                        unused;     /* keeps the data 16 byte aligned */
+};
+
+/* Lives in the first chunk of the region, just past its header */
+struct region_t {
+    char*                           bump;       /* next free byte of the current chunk */
+    char*                           limit;      /* end of the current chunk */
+    struct region_chunk_t*          chunks;     /* chunks after the first, newest first */
+    struct region_chunk_t*          chunks_tail; /* oldest of chunks, for splicing onto the freelist */
+    char*                           large;      /* data of large allocations, chained through their first word */
+    uint64_t                        unused;
+};
+
+static struct region_chunk_t*       free_chunks =     NULL; /* chunks of reset or destroyed regions */
+static pthread_mutex_t              region_lock =     PTHREAD_MUTEX_INITIALIZER; /* protects free_chunks */
+
+/* Per thread cache of freed slab slots, chained through their first word */
+struct tcache_t {
+    void*                           entries[TCACHE_BINS];
+    uint32_t                        counts[TCACHE_BINS];
+    char                            registered; /* 1 once the exit destructor is armed */
+};
+
+static __thread struct tcache_t     tcache;
+static pthread_key_t                tcache_key;
+static pthread_once_t               tcache_key_once = PTHREAD_ONCE_INIT;
+
+/* Per thread allocation counters. Only the owning thread writes them, MallocStats sums them */
+struct thread_stats_t {
+    uint64_t                        malloc_calls;
+    uint64_t                        free_calls;
+    uint64_t                        allocated_bytes; /* usable bytes handed out */
+    uint64_t                        freed_bytes;     /* usable bytes given back */
+    uint64_t                        cross_node_frees; /* blocks freed into an arena of another node */
+    struct thread_stats_t*          next;       /* live threads, chained from stats_threads */
+    struct thread_stats_t*          prev;
+    char                            linked;     /* 1 once on the list with its exit destructor armed */
+};
+
+static __thread struct thread_stats_t thread_stats;
+static struct thread_stats_t*       stats_threads = NULL; /* counters of live threads */
+static struct thread_stats_t        exited_stats;         /* counters folded in from exited threads */
+static pthread_mutex_t              stats_lock =   PTHREAD_MUTEX_INITIALIZER; /* protects the two above */
+static pthread_key_t                stats_key;
+static pthread_once_t               stats_key_once = PTHREAD_ONCE_INIT;
+static uint64_t                     mmap_blocks =  0;     /* live mmap_malloc blocks */
+static uint64_t                     mmap_bytes =   0;     /* bytes mapped by them */
+#ifdef MALLOC_HARDENED
+static uintptr_t                    harden_secret = 0;    /* keys canaries, slot marks and links, drawn by init */
+#endif
+
+/* Links through freed memory are stored XORed with their own address and
+ * harden_secret in MALLOC_HARDENED builds, so an overwrite or a leaked link
+ * does not give a usable pointer. Writes go through SET_LINK, reads through REVEAL_LINK */
+#ifdef MALLOC_HARDENED
+#define PROTECT_LINK(pos, ptr)      ((void*)((uintptr_t)(ptr) ^ ((uintptr_t)(pos) >> 12) ^ harden_secret))
+#else
+#define PROTECT_LINK(pos, ptr)      ((void*)(ptr))
+#endif
+#define REVEAL_LINK(link)           PROTECT_LINK(&(link), link)
+#define SET_LINK(link, ptr)         ((link) = PROTECT_LINK(&(link), ptr))
+
+#if defined(MALLOC_DEBUG) || defined(MALLOC_HARDENED)
+/* Report heap misuse on stderr and abort */
+static void __attribute__((noreturn)) malloc_fatal(const char* message) {
+    write(STDERR_FILENO, message, strlen(message));
+    write(STDERR_FILENO, "\n", 1);
+    abort();
+}
+#endif
+
+/* Fold the counters of an exiting thread into exited_stats */
+static void stats_exit(void* unused) {
+    (void)unused;
+    pthread_mutex_lock(&stats_lock);
+    if (thread_stats.prev != NULL) {
+        thread_stats.prev->next = thread_stats.next;
+    } else {
+        stats_threads = thread_stats.next;
+    }
+    if (thread_stats.next != NULL) {
+        thread_stats.next->prev = thread_stats.prev;
+    }
+    exited_stats.malloc_calls += thread_stats.malloc_calls;
+    exited_stats.free_calls += thread_stats.free_calls;
+    exited_stats.allocated_bytes += thread_stats.allocated_bytes;
+    exited_stats.freed_bytes += thread_stats.freed_bytes;
+    exited_stats.cross_node_frees += thread_stats.cross_node_frees;
+    pthread_mutex_unlock(&stats_lock);
+    memset(&thread_stats, 0, sizeof(thread_stats));
+}
+
+static void stats_key_create() {
+    pthread_key_create(&stats_key, stats_exit);
+}
+
+/* Put this thread's counters on stats_threads and arm the exit destructor */
+static void stats_register() {
+    pthread_once(&stats_key_once, stats_key_create);
+    pthread_setspecific(stats_key, &thread_stats);
+    pthread_mutex_lock(&stats_lock);
+    thread_stats.prev = NULL;
+    thread_stats.next = stats_threads;
+    if (stats_threads != NULL) {
+        stats_threads->prev = &thread_stats;
+    }
+    stats_threads = &thread_stats;
+    thread_stats.linked = 1;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Bump a counter of this thread. The relaxed store keeps concurrent readers well defined */
+static inline void stat_add(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+/* Count calls allocations totalling bytes usable bytes */
+static inline void stats_malloc(uint64_t calls, uint64_t bytes) {
+    if (!thread_stats.linked) {
+        stats_register();
+    }
+    stat_add(&thread_stats.malloc_calls, calls);
+    stat_add(&thread_stats.allocated_bytes, bytes);
+}
+
+/* Count calls frees totalling bytes usable bytes */
+static inline void stats_free(uint64_t calls, uint64_t bytes) {
+    if (!thread_stats.linked) {
+        stats_register();
+    }
+    stat_add(&thread_stats.free_calls, calls);
+    stat_add(&thread_stats.freed_bytes, bytes);
+}
+
+/* Count an in place resize from old_size to new_size usable bytes */
+static inline void stats_resize(uint64_t old_size, uint64_t new_size) {
+    stats_free(0, old_size);
+    stats_malloc(0, new_size);
+}
+
+#ifdef MALLOC_PROFILE
+/* A sampled live allocation */
+struct profile_sample_t {
+    void*                           ptr;
+    uint64_t                        size;       /* bytes counted against the sampling interval */
+    struct profile_sample_t*        next;       /* next in hash chain, or in the freelist */
+    uint32_t                        depth;      /* number of frames in stack */
+    void*                           stack[PROFILE_MAX_DEPTH];
+};
+
+static uint64_t                     profile_interval = PROFILE_INTERVAL; /* mean bytes between samples, 0 disables */
+static struct profile_sample_t*     profile_hash[PROFILE_HASH_SIZE]; /* live samples by address */
+static uint8_t                      profile_filter[PROFILE_FILTER_SIZE]; /* live samples per filter slot */
+static struct profile_sample_t*     profile_free_samples = NULL;   /* recycled records */
+static char*                        profile_pool =     NULL;       /* unused part of the last pool mapping */
+static char*                        profile_pool_end = NULL;
+static uint64_t                     profile_live_count = 0;
+static uint64_t                     profile_live_bytes = 0;
+static pthread_mutex_t              profile_lock =     PTHREAD_MUTEX_INITIALIZER; /* protects all of the above but the interval */
+static int                          profile_signal_fd = -1;        /* where a signal requested dump goes */
+static volatile sig_atomic_t        profile_dump_pending = 0;      /* set by the signal handler */
+static __thread int64_t             profile_countdown = 0;         /* bytes left before the next sample */
+static __thread uint64_t            profile_random = 0;            /* xorshift state, 0 until seeded */
+static __thread char                profile_busy = 0;              /* 1 while this thread is taking a sample */
+
+/* Natural log of x in (0, 1], from its exponent and a short atanh series, so libm is not needed */
+static double profile_log(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int exponent = (int)((bits >> 52) & 0x7ff) - 1023;
+    bits = (bits & ((1UL << 52) - 1)) | (1023UL << 52);
+    double mantissa;
+    memcpy(&mantissa, &bits, sizeof(mantissa));
+    double s = (mantissa - 1) / (mantissa + 1);
+    double s2 = s * s;
+    return exponent * 0.6931471805599453 + 2 * s * (1 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 / 9))));
+}
+
+/* Draw the distance to the next sample from an exponential distribution with mean profile_interval */
+static int64_t profile_next_interval() {
+    uint64_t interval = __atomic_load_n(&profile_interval, __ATOMIC_RELAXED);
+    if (interval == 0) {
+        return INT64_MAX;
+    }
+    if (profile_random == 0) {
+        profile_random = (uintptr_t)&profile_random ^ ((uint64_t)getpid() << 32) ^ 0x9e3779b97f4a7c15UL;
+    }
+    profile_random ^= profile_random << 13;
+    profile_random ^= profile_random >> 7;
+    profile_random ^= profile_random << 17;
+    double uniform = ((profile_random >> 11) + 1) * (1.0 / (1UL << 53));
+    return (int64_t)(-profile_log(uniform) * interval) + 1;
+}
+
+static inline unsigned int profile_hash_of(void* ptr) {
+    return (uint32_t)(((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15UL >> 32);
+}
+
+/* Write all of buffer to fd. Returns 0, or -1 on error */
+static int write_all(int fd, const char* buffer, uint64_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+static int profile_dump(int fd);
+
+/* Record a sample for ptr, and arm the countdown for the next one */
+static void __attribute__((noinline)) profile_sample(void* ptr, uint64_t size) {
+    char first = profile_random == 0;
+    profile_countdown = profile_next_interval();
+    if (first || profile_busy || ptr == NULL) {
+        // A thread's first countdown is drawn here rather than sampling its first allocation
+        return;
+    }
+    profile_busy = 1;
+    if (profile_dump_pending) {
+        profile_dump_pending = 0;
+        profile_dump(profile_signal_fd);
+    }
+    void* stack[PROFILE_MAX_DEPTH + 1];
+    int depth = backtrace(stack, PROFILE_MAX_DEPTH + 1);
+    pthread_mutex_lock(&profile_lock);
+    struct profile_sample_t* sample = profile_free_samples;
+    if (sample != NULL) {
+        profile_free_samples = sample->next;
+    } else {
+        if ((uint64_t)(profile_pool_end - profile_pool) < sizeof(struct profile_sample_t)) {
+            char* pool = mmap(NULL, PROFILE_POOL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (pool != MAP_FAILED) {
+                profile_pool = pool;
+                profile_pool_end = pool + PROFILE_POOL_SIZE;
+            }
+        }
+        if ((uint64_t)(profile_pool_end - profile_pool) >= sizeof(struct profile_sample_t)) {
+            sample = (struct profile_sample_t*)profile_pool;
+            profile_pool += sizeof(struct profile_sample_t);
+        }
+    }
+    if (sample != NULL) {
+        // Drop the frame of profile_sample itself
+        sample->depth = depth > 1 ? depth - 1 : 0;
+        memcpy(sample->stack, stack + 1, sample->depth * sizeof(void*));
+        sample->ptr = ptr;
+        sample->size = size;
+        unsigned int hash = profile_hash_of(ptr);
+        sample->next = profile_hash[hash % PROFILE_HASH_SIZE];
+        profile_hash[hash % PROFILE_HASH_SIZE] = sample;
+        __atomic_store_n(&profile_filter[hash % PROFILE_FILTER_SIZE], profile_filter[hash % PROFILE_FILTER_SIZE] + 1, __ATOMIC_RELAXED);
+        profile_live_count++;
+        profile_live_bytes += size;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    profile_busy = 0;
+}
+
+/* Count size bytes against the sampling countdown of this thread */
+static inline void profile_malloc(void* ptr, uint64_t size) {
+    profile_countdown -= size;
+    if (__builtin_expect(profile_countdown < 0, 0)) {
+        profile_sample(ptr, size);
+    }
+}
+
+/* Forget the sample of ptr, if it has one */
+static inline void profile_free(void* ptr) {
+    unsigned int hash = profile_hash_of(ptr);
+    if (__atomic_load_n(&profile_filter[hash % PROFILE_FILTER_SIZE], __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&profile_lock);
+    for (struct profile_sample_t** link = &profile_hash[hash % PROFILE_HASH_SIZE]; *link != NULL; link = &(*link)->next) {
+        struct profile_sample_t* sample = *link;
+        if (sample->ptr == ptr) {
+            *link = sample->next;
+            sample->next = profile_free_samples;
+            profile_free_samples = sample;
+            __atomic_store_n(&profile_filter[hash % PROFILE_FILTER_SIZE], profile_filter[hash % PROFILE_FILTER_SIZE] - 1, __ATOMIC_RELAXED);
+            profile_live_count--;
+            profile_live_bytes -= sample->size;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/* Write the live samples to fd in the heap_v2 text format read by pprof. Returns 0, or -1 on a write error */
+static int profile_dump(int fd) {
+    char line[64 + PROFILE_MAX_DEPTH * 20];
+    int failed = 0;
+    pthread_mutex_lock(&profile_lock);
+    int length = snprintf(line, sizeof(line), "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%lu\n",
+                          profile_live_count, profile_live_bytes, profile_live_count, profile_live_bytes,
+                          __atomic_load_n(&profile_interval, __ATOMIC_RELAXED));
+    failed |= write_all(fd, line, length);
+    for (unsigned int bucket = 0; bucket < PROFILE_HASH_SIZE && !failed; bucket++) {
+        for (struct profile_sample_t* sample = profile_hash[bucket]; sample != NULL && !failed; sample = sample->next) {
+            length = snprintf(line, sizeof(line), "1: %lu [1: %lu] @", sample->size, sample->size);
+            for (uint32_t i = 0; i < sample->depth; i++) {
+                length += snprintf(line + length, sizeof(line) - length, " %p", sample->stack[i]);
+            }
+            line[length++] = '\n';
+            failed |= write_all(fd, line, length);
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+    // pprof symbolizes the addresses with the mappings of the process
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        failed |= write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+        for (ssize_t got; !failed && (got = read(maps, line, sizeof(line))) > 0; ) {
+            failed |= write_all(fd, line, got);
+        }
+        close(maps);
+    }
+    return failed ? -1 : 0;
+}
+
+/* Only flags the dump, which the next sampled allocation writes out */
+static void profile_signal_handler(int signo) {
+    (void)signo;
+    profile_dump_pending = 1;
+}
+#else
+static inline void profile_malloc(void* ptr, uint64_t size) {
+    (void)ptr;
+    (void)size;
+}
+
+static inline void profile_free(void* ptr) {
+    (void)ptr;
+}
+#endif
+
+#ifdef MALLOC_TRACE
+/* Records of one thread waiting to be copied to the trace file */
+struct trace_buffer_t {
+    struct trace_buffer_t*          next;       /* buffers of live threads, chained from trace_buffers */
+    struct trace_buffer_t*          prev;
+    uint32_t                        count;
+    uint32_t                        busy;       /* 1 while the owner appends, so trace_close waits before flushing */
+    struct malloc_trace_record      records[TRACE_BUFFER_RECORDS];
+};
+
+#define TRACE_UNKNOWN               0           /* MALLOC_TRACE_FILE not looked at yet */
+#define TRACE_ON                    1
+#define TRACE_OFF                   2
+
+static int                          trace_state =   TRACE_UNKNOWN;
+static int                          trace_fd =      -1;
+static char*                        trace_window =  NULL; /* mapping of the file from trace_window_offset */
+static uint64_t                     trace_window_offset = 0;
+static uint64_t                     trace_window_used = 0; /* bytes of the window written */
+static struct trace_buffer_t*       trace_buffers = NULL;
+static uint32_t                     trace_threads = 0;    /* thread ids handed out */
+static pthread_mutex_t              trace_lock =    PTHREAD_MUTEX_INITIALIZER; /* protects all of the above */
+static pthread_key_t                trace_key;
+static pthread_once_t               trace_key_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_buffer_t* trace_buffer = NULL;
+static __thread uint32_t            trace_thread;
+static __thread uint32_t            trace_muted = 0;      /* nonzero inside calls that log themselves */
+
+/* Copy length bytes of records into the file, sliding the window as it fills. Called with trace_lock held */
+static void trace_write(const char* records, uint64_t length) {
+    while (length > 0 && trace_fd >= 0) {
+        if (trace_window == NULL || trace_window_used == TRACE_WINDOW_SIZE) {
+            if (trace_window != NULL) {
+                munmap(trace_window, TRACE_WINDOW_SIZE);
+                trace_window_offset += TRACE_WINDOW_SIZE;
+                trace_window_used = 0;
+            }
+            trace_window = NULL;
+            if (ftruncate(trace_fd, trace_window_offset + TRACE_WINDOW_SIZE) != 0) {
+                return;
+            }
+            char* window = mmap(NULL, TRACE_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd, trace_window_offset);
+            if (window == MAP_FAILED) {
+                return;
+            }
+            trace_window = window;
+        }
+        uint64_t chunk = TRACE_WINDOW_SIZE - trace_window_used;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(trace_window + trace_window_used, records, chunk);
+        trace_window_used += chunk;
+        records += chunk;
+        length -= chunk;
+    }
+}
+
+/* Copy the records of buffer to the file. Called with trace_lock held */
+static void trace_flush_buffer(struct trace_buffer_t* buffer) {
+    trace_write((const char*)buffer->records, buffer->count * sizeof(struct malloc_trace_record));
+    buffer->count = 0;
+}
+
+/* Flush the pending records of every thread and cut the file to what was written.
+ * Logging stops first, and each buffer is flushed once its owner is out of
+ * trace_record, so no thread appends to a buffer while it is copied */
+static void trace_close() {
+    pthread_mutex_lock(&trace_lock);
+    __atomic_store_n(&trace_state, TRACE_OFF, __ATOMIC_SEQ_CST);
+    for (struct trace_buffer_t* buffer = trace_buffers; buffer != NULL; buffer = buffer->next) {
+        while (__atomic_load_n(&buffer->busy, __ATOMIC_SEQ_CST)) {
+            sched_yield();
+        }
+        trace_flush_buffer(buffer);
+    }
+    if (trace_window != NULL) {
+        munmap(trace_window, TRACE_WINDOW_SIZE);
+        trace_window = NULL;
+    }
+    if (trace_fd >= 0) {
+        ftruncate(trace_fd, trace_window_offset + trace_window_used);
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    trace_window_offset = 0;
+    trace_window_used = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Flush the records of an exiting thread and give its buffer back */
+static void trace_exit(void* unused) {
+    (void)unused;
+    struct trace_buffer_t* buffer = trace_buffer;
+    pthread_mutex_lock(&trace_lock);
+    trace_flush_buffer(buffer);
+    if (buffer->prev != NULL) {
+        buffer->prev->next = buffer->next;
+    } else {
+        trace_buffers = buffer->next;
+    }
+    if (buffer->next != NULL) {
+        buffer->next->prev = buffer->prev;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    trace_buffer = NULL;
+    munmap(buffer, sizeof(struct trace_buffer_t));
+}
+
+static void trace_key_create() {
+    pthread_key_create(&trace_key, trace_exit);
+}
+
+/* A forked child shares the parent's file and window, so it stops logging */
+static void trace_fork_child() {
+    if (trace_fd >= 0) {
+        close(trace_fd);
+    }
+    trace_fd = -1;
+    trace_window = NULL;
+    trace_window_offset = 0;
+    trace_window_used = 0;
+    for (struct trace_buffer_t* buffer = trace_buffers; buffer != NULL; buffer = buffer->next) {
+        buffer->count = 0;
+    }
+    trace_state = TRACE_OFF;
+    pthread_mutex_init(&trace_lock, NULL);
+}
+
+static void trace_fork_prepare() {
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void trace_fork_parent() {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Open path as the trace file, with each %p replaced by the process id. The
+ * file is locked, so a second process given the same path leaves it alone
+ * instead of truncating it under the first one's mapping. Called with
+ * trace_lock held. Returns 0, or -1 if it can not be created or is in use */
+static int trace_open(const char* path) {
+    static char                     atfork_done = 0;
+    char name[4096];
+    uint64_t length = 0;
+    for (; *path != 0 && length < sizeof(name) - 24; path++) {
+        if (path[0] == '%' && path[1] == 'p') {
+            length += snprintf(name + length, sizeof(name) - length, "%d", (int)getpid());
+            path++;
+        } else {
+            name[length++] = *path;
+        }
+    }
+    name[length] = 0;
+    trace_fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (trace_fd >= 0 && (flock(trace_fd, LOCK_EX | LOCK_NB) != 0 || ftruncate(trace_fd, 0) != 0)) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    if (trace_fd >= 0 && !atfork_done) {
+        pthread_atfork(trace_fork_prepare, trace_fork_parent, trace_fork_child);
+        atfork_done = 1;
+    }
+    __atomic_store_n(&trace_state, trace_fd >= 0 ? TRACE_ON : TRACE_OFF, __ATOMIC_RELEASE);
+    return trace_fd >= 0 ? 0 : -1;
+}
+
+/* Look at MALLOC_TRACE_FILE on the first call */
+static void __attribute__((noinline)) trace_init() {
+    pthread_mutex_lock(&trace_lock);
+    char opened = 0;
+    if (trace_state == TRACE_UNKNOWN) {
+        const char* path = getenv("MALLOC_TRACE_FILE");
+        opened = path != NULL && trace_open(path) == 0;
+        if (!opened) {
+            __atomic_store_n(&trace_state, TRACE_OFF, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    if (opened) {
+        atexit(trace_close);
+    }
+}
+
+/* Map a buffer for this thread. Returns NULL when out of memory */
+static struct trace_buffer_t* __attribute__((noinline)) trace_buffer_create() {
+    struct trace_buffer_t* buffer = mmap(NULL, sizeof(struct trace_buffer_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        return NULL;
+    }
+    pthread_once(&trace_key_once, trace_key_create);
+    pthread_setspecific(trace_key, buffer);
+    pthread_mutex_lock(&trace_lock);
+    trace_thread = ++trace_threads;
+    buffer->prev = NULL;
+    buffer->next = trace_buffers;
+    if (trace_buffers != NULL) {
+        trace_buffers->prev = buffer;
+    }
+    trace_buffers = buffer;
+    pthread_mutex_unlock(&trace_lock);
+    trace_buffer = buffer;
+    return buffer;
+}
+
+/* Log one call. id is the block returned or freed, old the block resized or the alignment */
+static void trace_record(uint32_t op, void* id, uint64_t size, uint64_t old) {
+    int state = __atomic_load_n(&trace_state, __ATOMIC_ACQUIRE);
+    if (state == TRACE_UNKNOWN) {
+        trace_init();
+        state = __atomic_load_n(&trace_state, __ATOMIC_ACQUIRE);
+    }
+    if (state != TRACE_ON || trace_muted) {
+        return;
+    }
+    struct trace_buffer_t* buffer = trace_buffer;
+    if (buffer == NULL && (buffer = trace_buffer_create()) == NULL) {
+        return;
+    }
+    // Either trace_close sees busy and waits, or this sees the state it stored and backs off
+    __atomic_store_n(&buffer->busy, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&trace_state, __ATOMIC_SEQ_CST) != TRACE_ON) {
+        __atomic_store_n(&buffer->busy, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct malloc_trace_record* record = &buffer->records[buffer->count];
+    record->time = now.tv_sec * 1000000000UL + now.tv_nsec;
+    record->id = (uintptr_t)id;
+    record->size = size;
+    record->old = old;
+    record->thread = trace_thread;
+    record->op = op;
+    char full = ++buffer->count == TRACE_BUFFER_RECORDS;
+    __atomic_store_n(&buffer->busy, 0, __ATOMIC_RELEASE);
+    if (full) {
+        // trace_close may have flushed it meanwhile
+        pthread_mutex_lock(&trace_lock);
+        if (buffer->count == TRACE_BUFFER_RECORDS) {
+            trace_flush_buffer(buffer);
+        }
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+/* Stop logging the calls a traced call makes on its own behalf */
+static inline void trace_mute() {
+    trace_muted++;
+}
+
+static inline void trace_unmute() {
+    trace_muted--;
+}
+#else
+static inline void trace_record(uint32_t op, void* id, uint64_t size, uint64_t old) {
+    (void)op;
+    (void)id;
+    (void)size;
+    (void)old;
 }
 
-static char* heap =                 -1; /* starting address of heap*/
-static char* heap_end =             -1; /* end address of heap */
+static inline void trace_mute() {
+}
 
-static struct block_header_t*       last =         NULL; /* last block allocated */
-static struct block_header_t*       first =        NULL; /* first block allocated */
-static struct block_header_t*       free_list =    NULL; /* list of free blocks */
+static inline void trace_unmute() {
+}
+#endif
 
-/* returns footer given header */
+/* returns footer given header of a free block */
 static inline struct block_footer_t* get_footer_from_header(struct block_header_t* header) {
-    return (struct block_footer_t*)((char*)header + get_size(header) + sizeof(uint64_t));
+    return (struct block_footer_t*)((char*)header + get_size(header));
 }
 
-/* returns header given footer */
+/* returns header given footer of a free block */
 static inline struct block_header_t* get_header_from_footer(struct block_footer_t* footer) {
-    return (struct block_header_t*)((char*)footer - get_size(footer) - sizeof(uint64_t));
+    return (struct block_header_t*)((char*)footer - get_size(footer));
+}
+
+/* returns block following this one in the heap */
+static inline struct block_header_t* next_adjacent(struct block_header_t* block) {
+    return (struct block_header_t*)((char*)block + BLOCK_OVERHEAD + get_size(block));
 }
 
 /* returns address of block given address of data */
@@ -68,202 +990,2689 @@ static inline char* data_addr(struct block_header_t* m_block) {
 }
 
 /* next available address to allocate */
-static struct block_header_t* next_available_block() {
-    if (last == NULL) {
-        return heap;
+static struct block_header_t* next_available_block(struct arena_t* arena) {
+    if (arena->last == NULL) {
+        return arena->heap;
     } else {
-        return (char*)last + sizeof(uint64_t) + get_size(last) + sizeof(struct block_footer_t);
+        return next_adjacent(arena->last);
     }
 }
 
-/* round size to nearest multiple of 8 for alignment */
-static inline unsigned int round(uint64_t size) {
-    return ((size + 7) & (-8));
+/* returns arena owning block */
+static inline struct arena_t* arena_of(struct block_header_t* block) {
+    if ((char*)block >= main_heap && (char*)block < main_heap_end) {
+        return &main_arena;
+    }
+    return ((struct heap_info_t*)((uintptr_t)block & ~(ARENA_HEAP_SIZE - 1)))->arena;
 }
 
-/* Wrapper for sbrk() */
-static char Sbrk() {
-    void* returned_addr = sbrk(ALLOC_SIZE);
-    if (returned_addr != -1) {
-        heap_end = heap_end + ALLOC_SIZE;
-        return 0;
-    } else {
-        return 1;
-    }
+/* returns 1 if ptr is a slab slot, 0 otherwise */
+static inline char is_slab(void* ptr) {
+    return (char*)ptr >= slab_region && (char*)ptr < slab_region_end;
 }
 
-/* Add block to free list */
-static void add_to_free_list(struct block_header_t* block) {
-    block->next = free_list;
-    block->prev = NULL;
-    if (free_list != NULL) {
-        free_list->prev = block;
+#ifdef MALLOC_HARDENED
+/* Draw the secret from the random bytes the kernel hands every process. Called by init */
+static void harden_init() {
+    uint64_t random[2] = { 0, 0 };
+    void* at_random = (void*)getauxval(AT_RANDOM);
+    if (at_random != NULL) {
+        memcpy(random, at_random, sizeof(random));
     }
-    free_list = block;
-    set_free(block);
-    set_free(get_footer_from_header(block));
+    // The first word is libc's stack guard, so only the second is used and it is mixed first
+    harden_secret = (random[1] ^ (uintptr_t)&harden_secret) * 0x9e3779b97f4a7c15UL | 1;
 }
 
-/* Remove block from free list */
-static void remove_from_free_list(struct block_header_t* block) {
-    if (block->next != NULL) {
-        block->next->prev = block->prev;
+/* returns address of the canary of a heap or mapped block */
+static inline uint64_t* canary_addr(struct block_header_t* m_block) {
+    return (uint64_t*)(data_addr(m_block) + get_size(m_block) - CANARY_SIZE);
+}
+
+/* Write the canary of a block about to be handed out, or resized in place */
+static inline void harden_set_canary(struct block_header_t* m_block) {
+    *canary_addr(m_block) = harden_secret ^ (uintptr_t)m_block;
+}
+
+/* Abort unless m_block, passed in by the caller, looks like a live heap or mapped block.
+ * Only the block itself is read, so no lock is needed */
+static void harden_check_block(struct block_header_t* m_block) {
+    if (is_free(m_block)) {
+        malloc_fatal("Free: double free");
     }
-    if (block->prev != NULL) {
-        block->prev->next = block->next;
+    if (is_mmapped(m_block)) {
+        if (((uintptr_t)m_block - ((uint64_t*)m_block)[-1]) & (PAGE_SIZE - 1)) {
+            malloc_fatal("Free: corrupted block header");
+        }
+    } else {
+        if ((get_size(m_block) & (MALLOC_ALIGNMENT - 1)) != sizeof(uint64_t) || get_size(m_block) < MINIMUM_ALLOC_SIZE) {
+            malloc_fatal("Free: corrupted block header");
+        }
     }
-    if (block == free_list) {
-        free_list = block->next;
+    if (*canary_addr(m_block) != (harden_secret ^ (uintptr_t)m_block)) {
+        malloc_fatal("Free: canary overwritten, heap buffer overflow");
     }
-    set_used(block);
-    set_used(get_footer_from_header(block));
 }
 
-/* Called once to initialize heap */
-static void init() {
-    if (heap == -1) {
-        heap = (char*) sbrk(0);
-        void* returned_addr = sbrk(INIIAL_HEAP_SIZE);
-        if (returned_addr == -1) {
-            heap = -1;
-            heap_end = -1;
-        } else {
-            heap_end = heap + INIIAL_HEAP_SIZE;
+/* Abort unless the free block before heap block m_block, if any, agrees with its
+ * footer. A block freed twice after being merged into that neighbor fails here.
+ * Called with the owning arena's lock held */
+static void harden_check_prev(struct block_header_t* m_block) {
+    if (is_prev_free(m_block)) {
+        struct block_footer_t* prev_footer = (struct block_footer_t*)((char*)m_block - sizeof(struct block_footer_t));
+        struct block_header_t* prev_block = get_header_from_footer(prev_footer);
+        if (!is_free(prev_block) || get_size(prev_block) != prev_footer->size) {
+            malloc_fatal("Free: double free or corrupted previous block");
         }
     }
 }
 
-void* Malloc(uint64_t size) {
-    if (heap == -1) {
-        init();
+/* returns 1 if link, read from a free block, can be the address of a block header */
+static inline char harden_header_aligned(void* link) {
+    return ((uintptr_t)link & (MALLOC_ALIGNMENT - 1)) == sizeof(uint64_t);
+}
+
+/* Abort unless the free block about to leave its bin is intact and linked both ways */
+static void harden_check_unlink(struct arena_t* arena, struct block_header_t* block,
+                                struct block_header_t* next, struct block_header_t* prev, unsigned int index) {
+    if (!is_free(block) || get_footer_from_header(block)->size != get_size(block)) {
+        malloc_fatal("malloc: corrupted free block");
     }
-    if (heap == -1 || heap_end == -1) {
-        return NULL;
+    // Overwritten links reveal to garbage, which is rarely a header address
+    if ((next != NULL && !harden_header_aligned(next)) || (prev != NULL && !harden_header_aligned(prev))) {
+        malloc_fatal("malloc: corrupted free list");
     }
-    if (size < MINIMUM_ALLOC_SIZE) {
-        size = MINIMUM_ALLOC_SIZE;
+    if ((next != NULL && REVEAL_LINK(next->prev) != block)
+        || (prev != NULL ? REVEAL_LINK(prev->next) != block : arena->bins[index] != block)) {
+        malloc_fatal("malloc: corrupted free list");
     }
-    size = round(size);
-    // Find block in free list
-    struct block_header_t* m_block = free_list;
-    while (m_block != NULL) {
-        if (get_size(m_block) >= size) { // Found block
-            // Partition the block if remaining space is large enough
-            uint64_t total_size = get_size(m_block) + sizeof(struct block_header_t) + sizeof(struct block_footer_t);
-            uint64_t size_needed = size + sizeof(uint64_t) + sizeof(struct block_footer_t);
-            if (total_size - size_needed >= MINIMUM_BLOCK_SIZE) {
-                struct block_header_t* new_block = ((char*)m_block) + sizeof(uint64_t) + size + sizeof(struct block_footer_t);
-                new_block->size = total_size - size_needed - sizeof(struct block_footer_t) - sizeof(uint64_t);
-                add_to_free_list(new_block);
-                set_free(new_block);
-                set_free(get_footer_from_header(new_block));
-            }
-            m_block->size = size;
-            set_used(m_block);
-            set_used(get_footer_from_header(m_block));
-            return data_addr(m_block);
-        }
-        m_block = m_block->next;
-    }
-    struct block_header_t* next_block = next_available_block();
-    while (((char*)next_block) + sizeof(uint64_t) + size + sizeof(struct block_footer_t) > heap_end) {
-        if (Sbrk() == 1) {
-            return NULL;
-        }
+}
+
+/* Abort unless tree node is an intact free block whose links agree with its
+ * neighbors'. Tree links are followed before most are written, so each node is
+ * checked as the tree code reaches it. Called with the arena lock held */
+static void harden_check_node(struct arena_t* arena, struct tree_node_t* node) {
+    struct block_header_t* block = (struct block_header_t*)node;
+    if (!is_free(block) || get_size(block) < TREE_MIN_SIZE || get_footer_from_header(block)->size != get_size(block)) {
+        malloc_fatal("malloc: corrupted free block");
+    }
+    if ((node->left != NULL && !harden_header_aligned(node->left))
+        || (node->right != NULL && !harden_header_aligned(node->right))
+        || (node->parent != NULL && !harden_header_aligned(node->parent))) {
+        malloc_fatal("malloc: corrupted free tree");
     }
-    next_block->size = size;
-    set_used(next_block);
-    set_used(get_footer_from_header(next_block));
-    if (first == NULL) {
-        first = next_block;
+    if ((node->left != NULL && node->left->parent != node)
+        || (node->right != NULL && node->right->parent != node)
+        || (node->parent != NULL ? node->parent->left != node && node->parent->right != node : arena->tree != node)) {
+        malloc_fatal("malloc: corrupted free tree");
     }
-    last = next_block;
-    return data_addr(next_block);
 }
 
-void Free(void* p) {
-    if (p == 0) {
-        return;
-    }
-    char* ptr = p;
-    struct block_header_t* m_block = head_addr(ptr);
-    struct block_header_t* next_block = NULL;
-    struct block_header_t* prev_block = NULL;
-    if (m_block != first) {
-        struct block_footer_t* prev_footer = (char*)m_block - sizeof(struct block_footer_t);
-        prev_block = get_header_from_footer(prev_footer);
-    }
-    if (m_block != last) {
-        next_block = (char*)m_block + sizeof(uint64_t) + get_size(m_block) + sizeof(struct block_footer_t);
-    }
-    if (next_block != NULL && is_free(next_block)
-    && prev_block != NULL && is_free(prev_block)) {
-        remove_from_free_list(next_block);
-        remove_from_free_list(prev_block);
-        if (next_block == last) {
-            last = prev_block;
-        }
-        uint64_t total_size = get_size(prev_block) + get_size(m_block) + get_size(next_block) + 3 * sizeof(uint64_t) + 3 * sizeof(struct block_footer_t);
-        uint64_t usable_size = total_size - sizeof(uint64_t) - sizeof(struct block_footer_t);
-        prev_block->size = usable_size;
-        set_free(prev_block);
-        get_footer_from_header(prev_block)->size = usable_size;
-        set_free(get_footer_from_header(prev_block));
-        add_to_free_list(prev_block);
-    } else if (prev_block != NULL && is_free(prev_block)) {
-        remove_from_free_list(prev_block);
-        if (m_block == last) {
-            last = prev_block;
-        }
-        uint64_t total_size = get_size(prev_block) + get_size(m_block) + 2 * sizeof(uint64_t) + 2 * sizeof(struct block_footer_t);
-        uint64_t usable_size = total_size - sizeof(uint64_t) - sizeof(struct block_footer_t);
-        prev_block->size = usable_size;
-        set_free(prev_block);
-        get_footer_from_header(prev_block)->size = usable_size;
-        set_free(get_footer_from_header(prev_block));
-        add_to_free_list(prev_block);
-    } else if (next_block != NULL && is_free(next_block)) {
-        remove_from_free_list(next_block);
-        if (next_block == last) {
-            last = m_block;
-        }
-        uint64_t total_size = get_size(m_block) + get_size(next_block) + 2 * sizeof(uint64_t) + 2 * sizeof(struct block_footer_t);
-        uint64_t usable_size = total_size - sizeof(uint64_t) - sizeof(struct block_footer_t);
-        m_block->size = usable_size;
-        set_free(m_block);
-        get_footer_from_header(m_block)->size = usable_size;
-        set_free(get_footer_from_header(m_block));
-        add_to_free_list(m_block);
-    } else {
-        set_free(m_block);
-        set_free(get_footer_from_header(m_block));
-        add_to_free_list(m_block);
+/* returns the mark a freed slot carries in its second word */
+static inline uintptr_t slot_mark(void* slot) {
+    return ~harden_secret ^ (uintptr_t)slot;
+}
+
+/* Abort if slot, passed in by the caller, is already free */
+static inline void harden_check_slot(void* slot) {
+    if (((uintptr_t*)slot)[1] == slot_mark(slot)) {
+        malloc_fatal("Free: double free");
     }
 }
 
-#include <assert.h>
-#include <stdio.h>
-int main() {
-    char* prev = -1;
-    for (int i = 2; i < 200; i++) {
-        char* ptr = Malloc(i << 3);
-        if (prev != -1) {
-            struct block_header_t* prev_block = head_addr(prev);
-            uint64_t size_prev = get_size(prev_block);
-            struct block_header_t* block = head_addr(ptr);
-            if ((char*)prev_block + size_prev + sizeof(uint64_t) + sizeof(struct block_footer_t) != (char*)block) {
-                printf("prev: %p, prev size: %lu, block: %p size: %lu \n", prev_block, size_prev, block, get_size(block));
-            }
-        }
-        prev = ptr;
+/* Check and mark a slot the caller frees */
+static inline void harden_free_slot(void* slot) {
+    harden_check_slot(slot);
+    ((uintptr_t*)slot)[1] = slot_mark(slot);
+}
+
+/* Abort unless a link read from a free slot chain leads to a slot or ends it */
+static inline void harden_check_slot_link(void* next) {
+    if (next != NULL && (!is_slab(next) || ((uintptr_t)next & (MALLOC_ALIGNMENT - 1)) != 0)) {
+        malloc_fatal("malloc: corrupted slot chain");
     }
-    for (int i = 2; i < 200; i++) {
-        char* ptr1 = Malloc(i << 3);
-        Free(ptr1);
-        char* ptr2 = Malloc(i << 3);
-        Free(ptr2);
-        if (ptr1 != ptr2) {
-            printf("ptr1: %p, ptr2: %p \n", ptr1, ptr2);
+}
+
+/* Clear the mark of a slot handed out */
+static inline void harden_alloc_slot(void* slot) {
+    ((uintptr_t*)slot)[1] = 0;
+}
+#else
+static inline void harden_set_canary(struct block_header_t* m_block) {
+    (void)m_block;
+}
+
+static inline void harden_check_block(struct block_header_t* m_block) {
+    (void)m_block;
+}
+
+static inline void harden_check_prev(struct block_header_t* m_block) {
+    (void)m_block;
+}
+
+static inline void harden_check_slot(void* slot) {
+    (void)slot;
+}
+
+static inline void harden_free_slot(void* slot) {
+    (void)slot;
+}
+
+static inline void harden_check_slot_link(void* next) {
+    (void)next;
+}
+
+static inline void harden_alloc_slot(void* slot) {
+    (void)slot;
+}
+
+static inline void harden_check_node(struct arena_t* arena, struct tree_node_t* node) {
+    (void)arena;
+    (void)node;
+}
+#endif
+
+/* round size to nearest multiple of MALLOC_ALIGNMENT */
+static inline uint64_t round(uint64_t size) {
+    return ((size + MALLOC_ALIGNMENT - 1) & -MALLOC_ALIGNMENT);
+}
+
+/* returns block size for a request of size bytes. Header and data together fill
+ * a multiple of MALLOC_ALIGNMENT, which keeps the data of every block aligned */
+static inline uint64_t request_size(uint64_t size) {
+    if (size + CANARY_SIZE < MINIMUM_ALLOC_SIZE) {
+        return MINIMUM_ALLOC_SIZE;
+    }
+    return round(size + CANARY_SIZE + sizeof(uint64_t)) - sizeof(uint64_t);
+}
+
+/* returns growth chunk for arena, geometric in the size of its heap */
+static inline uint64_t growth_chunk(struct arena_t* arena) {
+    uint64_t chunk = (uint64_t)(arena->heap_end - arena->heap) >> HEAP_GROWTH_SHIFT;
+    chunk = (chunk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (chunk < ALLOC_SIZE) {
+        return ALLOC_SIZE;
+    }
+    return chunk < MAX_GROWTH_CHUNK ? chunk : MAX_GROWTH_CHUNK;
+}
+
+/* Make [start, end) of arena's reservation writable. In hugetlb mode whole huge
+ * pages are mapped from the pool, and the rest of the range as usual. Returns 0, or -1 on failure */
+static int heap_commit(struct arena_t* arena, char* start, char* end) {
+    if (arena->huge == MALLOC_HUGEPAGES_HUGETLB) {
+        char* huge_start = (char*)(((uintptr_t)start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        char* huge_end = (char*)((uintptr_t)end & ~(HUGE_PAGE_SIZE - 1));
+        if (huge_start < huge_end) {
+            if (mmap(huge_start, huge_end - huge_start, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) != MAP_FAILED) {
+                if (start < huge_start && mprotect(start, huge_start - start, PROT_READ | PROT_WRITE) != 0) {
+                    return -1;
+                }
+                return huge_end < end ? mprotect(huge_end, end - huge_end, PROT_READ | PROT_WRITE) : 0;
+            }
+            // A failed fixed mapping may have punched a hole in the reservation, so fill it back
+            // in, and stay on transparent huge pages now that the pool is dry
+            mmap(huge_start, huge_end - huge_start, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1, 0);
+            madvise(huge_start, huge_end - huge_start, MADV_HUGEPAGE);
+            arena->huge = MALLOC_HUGEPAGES_THP;
+        }
+    }
+    return mprotect(start, end - start, PROT_READ | PROT_WRITE);
+}
+
+/* Move a reserved arena to huge pages once its heap is dense enough to fill them.
+ * The whole reservation is advised so growth not served by hugetlbfs gets THP */
+static void heap_advise(struct arena_t* arena) {
+    int mode = __atomic_load_n(&hugepages, __ATOMIC_RELAXED);
+    if (arena->huge || mode == MALLOC_HUGEPAGES_OFF || arena->heap_max == NULL
+        || (uint64_t)(arena->heap_end - arena->heap) < HUGE_ARENA_SIZE) {
+        return;
+    }
+    char* start = (char*)(((uintptr_t)arena->heap + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    madvise(start, arena->heap_max - start, MADV_HUGEPAGE);
+    arena->huge = mode;
+}
+
+/* Wrapper for sbrk(). Grows heap_end by at least min_bytes, rounded up to a whole
+ * growth chunk. Arenas with a reserved range commit more of it instead */
+static char Sbrk(struct arena_t* arena, uint64_t min_bytes) {
+    uint64_t chunk = growth_chunk(arena);
+    uint64_t bytes = (min_bytes + chunk - 1) / chunk * chunk;
+    // End on a page boundary, which also realigns a heap that started off one
+    bytes = (((uintptr_t)arena->heap_end + bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) - (uintptr_t)arena->heap_end;
+    if (arena->heap_max != NULL) {
+        if (arena->huge) {
+            // End on a huge page boundary so a later trim never splits one
+            bytes = (((uintptr_t)arena->heap_end + bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1)) - (uintptr_t)arena->heap_end;
+        }
+        if ((uint64_t)(arena->heap_max - arena->heap_end) < bytes) {
+            bytes = arena->heap_max - arena->heap_end;
+            if (bytes < min_bytes) {
+                return 1;
+            }
+        }
+        char* commit_start = (char*)((uintptr_t)arena->heap_end & ~(PAGE_SIZE - 1));
+        arena->sbrk_calls++;
+        if (heap_commit(arena, commit_start, arena->heap_end + bytes) != 0) {
+            return 1;
+        }
+        arena->heap_end = arena->heap_end + bytes;
+        heap_advise(arena);
+        return 0;
+    }
+    void* returned_addr = sbrk(bytes);
+    arena->sbrk_calls++;
+    if (returned_addr == -1 && bytes > min_bytes) {
+        bytes = (((uintptr_t)arena->heap_end + min_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) - (uintptr_t)arena->heap_end;
+        returned_addr = sbrk(bytes);
+        arena->sbrk_calls++;
+    }
+    if (returned_addr == -1) {
+        return 1;
+    }
+    if (returned_addr != arena->heap_end) {
+        // Someone else moved the break, so the new space does not extend the heap
+        sbrk(-(intptr_t)bytes);
+        return 1;
+    }
+    arena->heap_end = arena->heap_end + bytes;
+    main_heap_end = arena->heap_end;
+    return 0;
+}
+
+/* returns bin that holds free blocks of given size */
+static inline unsigned int bin_index(uint64_t size) {
+    if (size < EXACT_BIN_LIMIT) {
+        return size >> 3;
+    }
+    unsigned int log = 63 - __builtin_clzll(size);
+    unsigned int index = EXACT_BINS
+        + ((log - __builtin_ctz(EXACT_BIN_LIMIT)) << BIN_SUBDIVISION_BITS)
+        + ((size >> (log - BIN_SUBDIVISION_BITS)) & ((1 << BIN_SUBDIVISION_BITS) - 1));
+    return index;
+}
+
+/* writes size to header of block, clearing the free bit but keeping the state of its neighbor */
+static inline void set_block_size(struct block_header_t* block, uint64_t size) {
+    block->size = size | (block->size & PREV_FREE_BIT);
+}
+
+/* returns 1 if node a orders before node b */
+static inline char tree_less(struct tree_node_t* a, struct tree_node_t* b) {
+    return get_size(a) < get_size(b) || (get_size(a) == get_size(b) && a < b);
+}
+
+/* Put node v where node u hangs in the tree */
+static inline void tree_replace(struct arena_t* arena, struct tree_node_t* u, struct tree_node_t* v) {
+    if (u->parent == NULL) {
+        arena->tree = v;
+    } else if (u == u->parent->left) {
+        u->parent->left = v;
+    } else {
+        u->parent->right = v;
+    }
+    if (v != NULL) {
+        v->parent = u->parent;
+    }
+}
+
+static void tree_rotate_left(struct arena_t* arena, struct tree_node_t* x) {
+    struct tree_node_t* y = x->right;
+    x->right = y->left;
+    if (y->left != NULL) {
+        y->left->parent = x;
+    }
+    tree_replace(arena, x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void tree_rotate_right(struct arena_t* arena, struct tree_node_t* x) {
+    struct tree_node_t* y = x->left;
+    x->left = y->right;
+    if (y->right != NULL) {
+        y->right->parent = x;
+    }
+    tree_replace(arena, x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+/* returns 1 if node is red. Missing leaves are black */
+static inline char tree_is_red(struct tree_node_t* node) {
+    return node != NULL && node->red;
+}
+
+static void tree_insert(struct arena_t* arena, struct tree_node_t* node) {
+    struct tree_node_t* parent = NULL;
+    struct tree_node_t** link = &arena->tree;
+    while (*link != NULL) {
+        parent = *link;
+        harden_check_node(arena, parent);
+        link = tree_less(node, parent) ? &parent->left : &parent->right;
+    }
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = parent;
+    node->red = 1;
+    *link = node;
+    // Restore the red-black properties on the way up
+    while (tree_is_red(node->parent)) {
+        parent = node->parent;
+        struct tree_node_t* grandparent = parent->parent;
+        if (parent == grandparent->left) {
+            struct tree_node_t* uncle = grandparent->right;
+            if (tree_is_red(uncle)) {
+                parent->red = 0;
+                uncle->red = 0;
+                grandparent->red = 1;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->right) {
+                tree_rotate_left(arena, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = 0;
+            grandparent->red = 1;
+            tree_rotate_right(arena, grandparent);
+        } else {
+            struct tree_node_t* uncle = grandparent->left;
+            if (tree_is_red(uncle)) {
+                parent->red = 0;
+                uncle->red = 0;
+                grandparent->red = 1;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->left) {
+                tree_rotate_right(arena, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = 0;
+            grandparent->red = 1;
+            tree_rotate_left(arena, grandparent);
+        }
+    }
+    arena->tree->red = 0;
+}
+
+static void tree_remove(struct arena_t* arena, struct tree_node_t* node) {
+    struct tree_node_t* child;
+    struct tree_node_t* parent;
+    char removed_red;
+    harden_check_node(arena, node);
+    if (node->left != NULL && node->right != NULL) {
+        // Move the successor into node's place
+        struct tree_node_t* successor = node->right;
+        harden_check_node(arena, successor);
+        while (successor->left != NULL) {
+            successor = successor->left;
+            harden_check_node(arena, successor);
+        }
+        removed_red = successor->red;
+        child = successor->right;
+        if (successor->parent == node) {
+            parent = successor;
+        } else {
+            parent = successor->parent;
+            parent->left = child;
+            if (child != NULL) {
+                child->parent = parent;
+            }
+            successor->right = node->right;
+            successor->right->parent = successor;
+        }
+        successor->left = node->left;
+        successor->left->parent = successor;
+        successor->red = node->red;
+        tree_replace(arena, node, successor);
+    } else {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        removed_red = node->red;
+        tree_replace(arena, node, child);
+    }
+    if (removed_red) {
+        return;
+    }
+    // A black node is gone: push the missing black up until it can be absorbed
+    while (child != arena->tree && !tree_is_red(child)) {
+        harden_check_node(arena, parent);
+        if (child == parent->left) {
+            struct tree_node_t* sibling = parent->right;
+            harden_check_node(arena, sibling);
+            if (sibling->red) {
+                sibling->red = 0;
+                parent->red = 1;
+                tree_rotate_left(arena, parent);
+                sibling = parent->right;
+            }
+            if (!tree_is_red(sibling->left) && !tree_is_red(sibling->right)) {
+                sibling->red = 1;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (!tree_is_red(sibling->right)) {
+                sibling->left->red = 0;
+                sibling->red = 1;
+                tree_rotate_right(arena, sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = 0;
+            sibling->right->red = 0;
+            tree_rotate_left(arena, parent);
+        } else {
+            struct tree_node_t* sibling = parent->left;
+            harden_check_node(arena, sibling);
+            if (sibling->red) {
+                sibling->red = 0;
+                parent->red = 1;
+                tree_rotate_right(arena, parent);
+                sibling = parent->left;
+            }
+            if (!tree_is_red(sibling->left) && !tree_is_red(sibling->right)) {
+                sibling->red = 1;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (!tree_is_red(sibling->left)) {
+                sibling->right->red = 0;
+                sibling->red = 1;
+                tree_rotate_left(arena, sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = 0;
+            sibling->left->red = 0;
+            tree_rotate_right(arena, parent);
+        }
+        child = arena->tree;
+    }
+    if (child != NULL) {
+        child->red = 0;
+    }
+}
+
+/* returns smallest node of at least size bytes, lowest address first, or NULL */
+static struct tree_node_t* tree_best_fit(struct arena_t* arena, uint64_t size) {
+    struct tree_node_t* best = NULL;
+    struct tree_node_t* node = arena->tree;
+    while (node != NULL) {
+        harden_check_node(arena, node);
+        if (get_size(node) >= size) {
+            best = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return best;
+}
+
+/* returns in order successor of node, or first node if node is NULL */
+static struct tree_node_t* tree_next(struct arena_t* arena, struct tree_node_t* node) {
+    if (node == NULL || node->right != NULL) {
+        node = node == NULL ? arena->tree : node->right;
+        while (node != NULL && node->left != NULL) {
+            harden_check_node(arena, node);
+            node = node->left;
+        }
+        if (node != NULL) {
+            harden_check_node(arena, node);
+        }
+        return node;
+    }
+    while (node->parent != NULL && node == node->parent->right) {
+        node = node->parent;
+        harden_check_node(arena, node);
+    }
+    if (node->parent != NULL) {
+        harden_check_node(arena, node->parent);
+    }
+    return node->parent;
+}
+
+/* Add block to free list */
+static void add_to_free_list(struct arena_t* arena, struct block_header_t* block) {
+    if (get_size(block) >= TREE_MIN_SIZE) {
+        struct tree_node_t* node = (struct tree_node_t*)block;
+        tree_insert(arena, node);
+        node->freed_at = __atomic_load_n(&decay_clock, __ATOMIC_RELAXED);
+        node->decay_state = DECAY_DIRTY;
+    } else {
+        unsigned int index = bin_index(get_size(block));
+        SET_LINK(block->next, arena->bins[index]);
+        SET_LINK(block->prev, NULL);
+        if (arena->bins[index] != NULL) {
+            SET_LINK(arena->bins[index]->prev, block);
+        }
+        arena->bins[index] = block;
+        arena->bin_map |= (uint64_t)1 << index;
+    }
+    set_free(block);
+    get_footer_from_header(block)->size = get_size(block);
+    if (block != arena->last) {
+        next_adjacent(block)->size |= PREV_FREE_BIT;
+    }
+}
+
+/* Remove block from free list */
+static void remove_from_free_list(struct arena_t* arena, struct block_header_t* block) {
+    if (get_size(block) >= TREE_MIN_SIZE) {
+        tree_remove(arena, (struct tree_node_t*)block);
+    } else {
+        unsigned int index = bin_index(get_size(block));
+        struct block_header_t* next = REVEAL_LINK(block->next);
+        struct block_header_t* prev = REVEAL_LINK(block->prev);
+#ifdef MALLOC_HARDENED
+        harden_check_unlink(arena, block, next, prev, index);
+#endif
+        if (next != NULL) {
+            SET_LINK(next->prev, prev);
+        }
+        if (prev != NULL) {
+            SET_LINK(prev->next, next);
+        }
+        if (block == arena->bins[index]) {
+            arena->bins[index] = next;
+            if (arena->bins[index] == NULL) {
+                arena->bin_map &= ~((uint64_t)1 << index);
+            }
+        }
+    }
+    set_used(block);
+    if (block != arena->last) {
+        next_adjacent(block)->size &= ~PREV_FREE_BIT;
+    }
+}
+
+/* Find a free block of at least size bytes, or NULL if there is none.
+ * Every block in a bin above the one for size is large enough, so only the
+ * request's own bin may need a scan, and only when it is not an exact bin.
+ * Large requests, and small ones no bin can serve, take the best fit in the tree */
+static struct block_header_t* find_free_block(struct arena_t* arena, uint64_t size) {
+    if (size < TREE_MIN_SIZE) {
+        unsigned int index = bin_index(size);
+        if (index >= EXACT_BINS) {
+            for (struct block_header_t* m_block = arena->bins[index]; m_block != NULL; m_block = REVEAL_LINK(m_block->next)) {
+                if (get_size(m_block) >= size) {
+                    return m_block;
+                }
+            }
+            index++;
+        }
+        uint64_t map = index < NUM_BINS ? arena->bin_map & (~(uint64_t)0 << index) : 0;
+        if (map != 0) {
+            return arena->bins[__builtin_ctzll(map)];
+        }
+    }
+    return (struct block_header_t*)tree_best_fit(arena, size);
+}
+
+/* Take block off the free list and split off the tail if it is large enough for another block */
+static void allocate_free_block(struct arena_t* arena, struct block_header_t* m_block, uint64_t size) {
+    remove_from_free_list(arena, m_block);
+    uint64_t block_size = get_size(m_block);
+    if (block_size - size >= MINIMUM_BLOCK_SIZE) {
+        set_block_size(m_block, size);
+        struct block_header_t* new_block = next_adjacent(m_block);
+        new_block->size = block_size - size - BLOCK_OVERHEAD;
+        if (m_block == arena->last) {
+            arena->last = new_block;
+        }
+        add_to_free_list(arena, new_block);
+    }
+}
+
+/* Record that a block may have been written up to its end */
+static inline void claim_clean(struct arena_t* arena, struct block_header_t* m_block) {
+    char* block_end = (char*)m_block + BLOCK_OVERHEAD + get_size(m_block);
+    if (block_end > arena->clean) {
+        arena->clean = block_end;
+    }
+}
+
+/* Release the whole pages inside a free block with advice, MADV_DONTNEED or MADV_FREE,
+ * keeping its links or tree node and footer. Arenas on huge pages release only
+ * whole huge pages. Returns 1 if any page was released, 0 if the block holds no whole
+ * page, or -1 with errno set if madvise failed */
+static int purge_free_block(struct arena_t* arena, struct block_header_t* block, int advice) {
+    uint64_t page = arena->huge ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    uintptr_t start = ((uintptr_t)block + sizeof(struct tree_node_t) + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t)get_footer_from_header(block) & ~(page - 1);
+    if (end <= start) {
+        return 0;
+    }
+    return madvise((void*)start, end - start, advice) == 0 ? 1 : -1;
+}
+
+/* Give the memory past the first keep bytes of the free tail block of arena
+ * back to the system by lowering heap_end. Returns 1 if any memory was released.
+ * Called with arena->lock held */
+static char trim_arena(struct arena_t* arena, uint64_t keep) {
+    struct block_header_t* tail = arena->last;
+    if (tail == NULL || !is_free(tail)) {
+        return 0;
+    }
+    // The tail stays behind so last never has to be found by walking back over used blocks
+    if (keep < MINIMUM_BLOCK_SIZE) {
+        keep = MINIMUM_BLOCK_SIZE;
+    }
+    uint64_t page = arena->huge ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    char* new_end = (char*)(((uintptr_t)tail + keep + sizeof(uint64_t) + page - 1) & ~(page - 1));
+    if (new_end >= arena->heap_end) {
+        return 0;
+    }
+    if (arena->heap_max == NULL && sbrk(0) != arena->heap_end) {
+        // The break moved under us, so the tail can only be released in place
+        return purge_free_block(arena, tail, MADV_DONTNEED) > 0;
+    }
+    remove_from_free_list(arena, tail);
+    set_block_size(tail, new_end - sizeof(uint64_t) - (char*)tail - BLOCK_OVERHEAD);
+    add_to_free_list(arena, tail);
+    claim_clean(arena, tail);
+    if (arena->huge) {
+        // Mapping over the range frees hugetlb pages too, which madvise may not
+        mmap(new_end, arena->heap_end - new_end, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        madvise(new_end, arena->heap_end - new_end, MADV_HUGEPAGE);
+    } else if (arena->heap_max != NULL) {
+        madvise(new_end, arena->heap_end - new_end, MADV_DONTNEED);
+        mprotect(new_end, arena->heap_end - new_end, PROT_NONE);
+    } else {
+        sbrk(-(intptr_t)(arena->heap_end - new_end));
+        main_heap_end = new_end;
+    }
+    arena->heap_end = new_end;
+    if (arena->clean > new_end) {
+        // Released pages come back zeroed
+        arena->clean = new_end;
+    }
+    return 1;
+}
+
+/* Count the NUMA nodes as one more than the highest online node in sysfs. Returns 1 if it can not be read */
+static unsigned int numa_count() {
+    char buffer[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    unsigned int highest = 0;
+    unsigned int value = 0;
+    for (ssize_t i = 0; i < length; i++) {
+        if (buffer[i] >= '0' && buffer[i] <= '9') {
+            value = value * 10 + (buffer[i] - '0');
+            if (value > highest) {
+                highest = value;
+            }
+        } else {
+            value = 0;
+        }
+    }
+    return highest < MAX_NUMA_NODES ? highest + 1 : MAX_NUMA_NODES;
+}
+
+/* Ask for the pages of [start, start + length) to come from node, moving any already touched */
+static void numa_bind(void* start, uint64_t length, int node) {
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, start, length, MPOL_PREFERRED, &mask, MAX_NUMA_NODES + 1, MPOL_MF_MOVE);
+}
+
+/* Arena slots given to each node */
+static inline unsigned int numa_arenas_per_node() {
+    unsigned int per_node = (narenas < MAX_ARENAS ? narenas : MAX_ARENAS - 1) / numa_nodes;
+    return per_node > 0 ? per_node : 1;
+}
+
+/* Slot of the arena i of node, counting from 0 */
+static inline unsigned int numa_arena_index(unsigned int node, unsigned int i) {
+    unsigned int per_node = numa_arenas_per_node();
+    return 1 + node * per_node + i % per_node;
+}
+
+/* Parse a size such as 4096, 64k or 2m. Returns 0, or -1 if text is not one */
+static int conf_size(const char* text, uint64_t length, uint64_t* value) {
+    uint64_t result = 0;
+    uint64_t i = 0;
+    for (; i < length && text[i] >= '0' && text[i] <= '9'; i++) {
+        result = result * 10 + (text[i] - '0');
+    }
+    if (i == 0) {
+        return -1;
+    }
+    if (i + 1 == length) {
+        switch (text[i] | 0x20) {
+        case 'k': result <<= 10; break;
+        case 'm': result <<= 20; break;
+        case 'g': result <<= 30; break;
+        default: return -1;
+        }
+    } else if (i != length) {
+        return -1;
+    }
+    *value = result;
+    return 0;
+}
+
+/* MALLOC_CONF names of the Mallopt parameters */
+static const struct {
+    const char*                     name;
+    int                             param;
+} conf_options[] = {
+    { "mmap_threshold",             MALLOC_OPT_MMAP_THRESHOLD },
+    { "trim_threshold",             MALLOC_OPT_TRIM_THRESHOLD },
+    { "profile_interval",           MALLOC_OPT_PROFILE_INTERVAL },
+    { "tcache_max",                 MALLOC_OPT_TCACHE_MAX },
+    { "tcache_fill",                MALLOC_OPT_TCACHE_FILL },
+    { "hugepages",                  MALLOC_OPT_HUGEPAGES },
+    { "decay_time",                 MALLOC_OPT_DECAY_TIME },
+};
+
+/* Apply one name:value pair of MALLOC_CONF. Returns 0, or -1 if it is not understood */
+static int conf_apply(const char* name, uint64_t name_length, uint64_t value) {
+    if (name_length == 6 && memcmp(name, "arenas", 6) == 0) {
+        if (value == 0) {
+            return -1;
+        }
+        __atomic_store_n(&narenas, value < MAX_ARENAS ? value : MAX_ARENAS, __ATOMIC_RELEASE);
+        return 0;
+    }
+    for (unsigned int i = 0; i < sizeof(conf_options) / sizeof(conf_options[0]); i++) {
+        if (strlen(conf_options[i].name) == name_length && memcmp(conf_options[i].name, name, name_length) == 0) {
+            return Mallopt(conf_options[i].param, value);
+        }
+    }
+    return -1;
+}
+
+/* Read MALLOC_CONF, such as "mmap_threshold:1m,arenas:4". Bad pairs are reported and skipped */
+static void conf_parse(const char* conf) {
+    while (conf != NULL && *conf != 0) {
+        const char* end = strchr(conf, ',');
+        if (end == NULL) {
+            end = conf + strlen(conf);
+        }
+        const char* colon = memchr(conf, ':', end - conf);
+        uint64_t value;
+        if (colon == NULL || conf_size(colon + 1, end - colon - 1, &value) != 0
+            || conf_apply(conf, colon - conf, value) != 0) {
+            static const char message[] = "malloc: ignoring bad MALLOC_CONF pair: ";
+            write(STDERR_FILENO, message, sizeof(message) - 1);
+            write(STDERR_FILENO, conf, end - conf);
+            write(STDERR_FILENO, "\n", 1);
+        }
+        conf = *end == ',' ? end + 1 : end;
+    }
+}
+
+/* Called once, from the library constructor or the first arena selection,
+ * whichever comes first. Counts the NUMA nodes, reads MALLOC_CONF and sizes
+ * the arena table */
+static void init() {
+#ifdef MALLOC_HARDENED
+    harden_init();
+#endif
+    numa_nodes = numa_count();
+    conf_parse(getenv("MALLOC_CONF"));
+    if (narenas == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        __atomic_store_n(&narenas, cpus < 1 ? 1 : cpus > MAX_ARENAS ? MAX_ARENAS : cpus, __ATOMIC_RELEASE);
+    }
+}
+
+static void __attribute__((constructor)) init_early() {
+    pthread_once(&init_once, init);
+}
+
+/* Reserve size bytes of address space aligned to align, a power of two. Returns NULL on failure */
+static char* reserve_aligned(uint64_t size, uint64_t align) {
+    char* region = mmap(NULL, size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    // Keep only the aligned part of the mapping
+    char* aligned = (char*)(((uintptr_t)region + align - 1) & ~(align - 1));
+    if (aligned != region) {
+        munmap(region, aligned - region);
+    }
+    munmap(aligned + size, region + align - aligned);
+    return aligned;
+}
+
+/* Set the main arena up in a reservation aligned to a huge page, so it can move
+ * to huge pages like the others. Returns 0, or -1 if the range is not available */
+static int heap_init_reserved() {
+    char* region = reserve_aligned(MAIN_HEAP_RESERVE, HUGE_PAGE_SIZE);
+    if (region == NULL) {
+        return -1;
+    }
+    if (mprotect(region, INIIAL_HEAP_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        munmap(region, MAIN_HEAP_RESERVE);
+        return -1;
+    }
+    main_arena.heap = region + sizeof(uint64_t);
+    main_arena.heap_end = region + INIIAL_HEAP_SIZE;
+    main_arena.heap_max = region + MAIN_HEAP_RESERVE;
+    main_arena.clean = main_arena.heap;
+    main_heap = region;
+    main_heap_end = main_arena.heap_max;
+    return 0;
+}
+
+/* Called on the first request for the main heap, until it can be set up. It
+ * lives on sbrk unless huge pages were asked for */
+static void heap_init() {
+    if (main_arena.heap == -1 && __atomic_load_n(&hugepages, __ATOMIC_RELAXED) != MALLOC_HUGEPAGES_OFF) {
+        heap_init_reserved();
+    }
+    if (main_arena.heap == -1) {
+        char* brk = (char*) sbrk(0);
+        // Start the first header 8 bytes below a 16 byte boundary so block data is aligned
+        uint64_t pad = (sizeof(uint64_t) - ((uintptr_t)brk & (MALLOC_ALIGNMENT - 1))) & (MALLOC_ALIGNMENT - 1);
+        void* returned_addr = sbrk(INIIAL_HEAP_SIZE + pad);
+        if (returned_addr == -1) {
+            main_arena.heap = -1;
+            main_arena.heap_end = -1;
+        } else {
+            main_arena.heap = brk + pad;
+            main_arena.heap_end = main_arena.heap + INIIAL_HEAP_SIZE;
+            main_arena.clean = main_arena.heap;
+            main_heap = main_arena.heap;
+            main_heap_end = main_arena.heap_end;
+        }
+    }
+}
+
+/* Reserve an aligned address range and set up a new arena at its start, bound
+ * to node unless it is -1. Returns NULL on failure */
+static struct arena_t* arena_create(int node) {
+    char* aligned = reserve_aligned(ARENA_HEAP_SIZE, ARENA_HEAP_SIZE);
+    if (aligned == NULL) {
+        return NULL;
+    }
+    if (node >= 0) {
+        // Bound before the first touch, so even the arena's own header is local
+        numa_bind(aligned, ARENA_HEAP_SIZE, node);
+    }
+    uint64_t meta_size = round(sizeof(struct heap_info_t) + sizeof(struct arena_t) + 63);
+    if (mprotect(aligned, meta_size + INIIAL_HEAP_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        munmap(aligned, ARENA_HEAP_SIZE);
+        return NULL;
+    }
+    struct heap_info_t* info = (struct heap_info_t*)aligned;
+    struct arena_t* arena = (struct arena_t*)(((uintptr_t)(info + 1) + 63) & ~(uintptr_t)63);
+    info->arena = arena;
+    arena->segment = info;
+    // First header sits 8 bytes past an aligned address so block data is aligned
+    arena->heap = aligned + meta_size + sizeof(uint64_t);
+    arena->heap_end = aligned + meta_size + INIIAL_HEAP_SIZE;
+    arena->heap_max = aligned + ARENA_HEAP_SIZE;
+    arena->clean = arena->heap;
+    arena->node = node;
+    pthread_mutex_init(&arena->lock, NULL);
+    return arena;
+}
+
+/* Close arena's current segment, which cannot grow, and carry on in a new
+ * aligned reservation with room for a block of size bytes. The old segment ends
+ * in a used header of size 0 so coalescing never runs past it. Returns 0, or -1
+ * if no reservation could be had. Called with arena->lock held */
+static int segment_open(struct arena_t* arena, uint64_t size) {
+    uint64_t meta_size = round(sizeof(struct heap_info_t));
+    uint64_t need = meta_size + sizeof(uint64_t) + BLOCK_OVERHEAD + size + SENTINEL_SIZE;
+    if (need > ARENA_HEAP_SIZE) {
+        return -1;
+    }
+    char* aligned = reserve_aligned(ARENA_HEAP_SIZE, ARENA_HEAP_SIZE);
+    if (aligned == NULL) {
+        return -1;
+    }
+    if (arena->node >= 0) {
+        numa_bind(aligned, ARENA_HEAP_SIZE, arena->node);
+    }
+    uint64_t commit = (need + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    arena->sbrk_calls++;
+    if (mprotect(aligned, commit, PROT_READ | PROT_WRITE) != 0) {
+        munmap(aligned, ARENA_HEAP_SIZE);
+        return -1;
+    }
+    struct heap_info_t* info = (struct heap_info_t*)aligned;
+    info->arena = arena;
+    info->prev = arena->segment;
+    if (arena->heap != (char*)-1) {
+        // Free blocks of the old segment stay in the bins, the sentinel fits in the room kept past last
+        struct block_header_t* sentinel = next_available_block(arena);
+        sentinel->size = arena->last != NULL && is_free(arena->last) ? PREV_FREE_BIT : 0;
+        info->prev_heap = arena->heap;
+        info->prev_heap_end = arena->heap_end;
+    }
+    arena->segment = info;
+    arena->heap = aligned + meta_size + sizeof(uint64_t);
+    arena->heap_end = aligned + commit;
+    arena->heap_max = aligned + ARENA_HEAP_SIZE;
+    arena->clean = arena->heap;
+    arena->last = NULL;
+    arena->huge = 0;
+    return 0;
+}
+
+/* Return the arena in slot index, creating it on first use. Falls back to the main arena */
+static struct arena_t* arena_get(unsigned int index) {
+    struct arena_t* arena = __atomic_load_n(&arenas[index], __ATOMIC_ACQUIRE);
+    if (arena == NULL) {
+        pthread_mutex_lock(&arenas_lock);
+        arena = arenas[index];
+        if (arena == NULL) {
+            arena = arena_create(numa_nodes > 1 ? (int)((index - 1) / numa_arenas_per_node()) : -1);
+            if (arena == NULL) {
+                arena = &main_arena;
+            } else {
+                __atomic_store_n(&arenas[index], arena, __ATOMIC_RELEASE);
+            }
+        }
+        pthread_mutex_unlock(&arenas_lock);
+    }
+    return arena;
+}
+
+static void decay_start();
+static void remote_drain(struct arena_t* arena);
+
+/* Detach the calling thread from its arena. Once the last thread is gone no
+ * one polls the remote free list, so what is queued is freed now, and later
+ * frees take the lock. Runs as the arena_key destructor on thread exit */
+static void arena_detach(void* unused) {
+    (void)unused;
+    struct arena_t* arena = thread_arena;
+    if (arena == NULL) {
+        return;
+    }
+    thread_arena = NULL;
+    if (__atomic_sub_fetch(&arena->threads, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&arena->lock);
+        remote_drain(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+static void arena_key_create() {
+    pthread_key_create(&arena_key, arena_detach);
+}
+
+/* Pick the arena for the calling thread, round robin over those of the node it runs on */
+static struct arena_t* arena_select() {
+    if (__atomic_load_n(&narenas, __ATOMIC_ACQUIRE) == 0) {
+        pthread_once(&init_once, init);
+    }
+    unsigned int index = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+    if (numa_nodes > 1) {
+        unsigned int node = 0;
+        getcpu(NULL, &node);
+        thread_node = node < numa_nodes ? node : 0;
+        index = numa_arena_index(thread_node, index);
+    } else {
+        index %= narenas;
+    }
+    struct arena_t* arena = arena_get(index);
+    if (thread_arena == NULL) {
+        pthread_once(&arena_key_once, arena_key_create);
+    } else {
+        arena_detach(NULL);
+    }
+    __atomic_add_fetch(&arena->threads, 1, __ATOMIC_SEQ_CST);
+    thread_arena = arena;
+    // May allocate, which finds thread_arena already set
+    pthread_setspecific(arena_key, arena);
+    if (__atomic_load_n(&decay_time, __ATOMIC_RELAXED) != 0 && !__atomic_load_n(&decay_running, __ATOMIC_RELAXED)) {
+        // A decay time from MALLOC_CONF is read by init, too early to create a thread
+        decay_start();
+    }
+    return thread_arena;
+}
+
+/* The calling thread's arena, picked again when the thread has moved to another node */
+static inline struct arena_t* local_arena() {
+    if (thread_arena == NULL) {
+        return arena_select();
+    }
+    if (numa_nodes > 1) {
+        unsigned int node = 0;
+        if (getcpu(NULL, &node) == 0 && (int)node != thread_node) {
+            return arena_select();
+        }
+    }
+    return thread_arena;
+}
+
+/* Count n blocks freed into arena by a thread of another node */
+static inline void numa_count_free(struct arena_t* arena, uint64_t n) {
+    if (arena->node >= 0 && arena->node != thread_node) {
+        stat_add(&thread_stats.cross_node_frees, n);
+    }
+}
+
+/* Return block to arena, coalescing with free neighbors. Called with arena->lock held */
+static void heap_free(struct arena_t* arena, struct block_header_t* m_block) {
+    uint64_t size = get_size(m_block);
+    if (m_block != arena->last) {
+        struct block_header_t* next_block = next_adjacent(m_block);
+        if (is_free(next_block)) {
+            remove_from_free_list(arena, next_block);
+            if (next_block == arena->last) {
+                arena->last = m_block;
+            }
+            size += BLOCK_OVERHEAD + get_size(next_block);
+        }
+    }
+    if (is_prev_free(m_block)) {
+        struct block_footer_t* prev_footer = (char*)m_block - sizeof(struct block_footer_t);
+        struct block_header_t* prev_block = get_header_from_footer(prev_footer);
+        remove_from_free_list(arena, prev_block);
+        if (m_block == arena->last) {
+            arena->last = prev_block;
+        }
+        size += BLOCK_OVERHEAD + get_size(prev_block);
+        m_block = prev_block;
+    }
+    set_block_size(m_block, size);
+    add_to_free_list(arena, m_block);
+    // With a decay time the decay thread releases the memory later, off the caller's path
+    if (size >= __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED) && __atomic_load_n(&decay_time, __ATOMIC_RELAXED) == 0) {
+        if (m_block == arena->last) {
+            // Trim only well past the threshold and keep a pad, so a heap that shrinks and grows back does not syscall both ways
+            if (size >= __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED) + TRIM_PAD) {
+                trim_arena(arena, TRIM_PAD);
+            }
+        } else {
+            purge_free_block(arena, m_block, MADV_DONTNEED);
+        }
+    }
+}
+
+#ifdef MALLOC_DEFERRED_COALESCE
+/* Park a freed block in its fastbin. Called with arena->lock held */
+static inline void fastbin_put(struct arena_t* arena, struct block_header_t* m_block) {
+    unsigned int index = get_size(m_block) >> 4;
+#ifdef MALLOC_HARDENED
+    if (arena->fastbins[index] == m_block) {
+        malloc_fatal("Free: double free");
+    }
+#endif
+    SET_LINK(m_block->next, arena->fastbins[index]);
+    arena->fastbins[index] = m_block;
+    arena->fastbin_count++;
+}
+
+/* Pop a block of exactly size bytes off its fastbin, or NULL. Called with arena->lock held */
+static inline struct block_header_t* fastbin_get(struct arena_t* arena, uint64_t size) {
+    struct block_header_t* m_block = arena->fastbins[size >> 4];
+    if (m_block != NULL) {
+        arena->fastbins[size >> 4] = REVEAL_LINK(m_block->next);
+        arena->fastbin_count--;
+#ifdef MALLOC_HARDENED
+        struct block_header_t* next = arena->fastbins[size >> 4];
+        if (get_size(m_block) != size || (next != NULL && !harden_header_aligned(next))) {
+            malloc_fatal("malloc: corrupted fastbin");
+        }
+#endif
+    }
+    return m_block;
+}
+
+/* Coalesce every parked block back into the free bins. Called with arena->lock held */
+static void fastbin_consolidate(struct arena_t* arena) {
+    for (unsigned int index = 0; index < FASTBINS; index++) {
+        struct block_header_t* m_block = arena->fastbins[index];
+        arena->fastbins[index] = NULL;
+        while (m_block != NULL) {
+            struct block_header_t* next = REVEAL_LINK(m_block->next);
+#ifdef MALLOC_HARDENED
+            if (next != NULL && !harden_header_aligned(next)) {
+                malloc_fatal("malloc: corrupted fastbin");
+            }
+#endif
+            // Only the newest parked block is checked when freed, this catches the rest
+            harden_check_block(m_block);
+            heap_free(arena, m_block);
+            m_block = next;
+        }
+    }
+    arena->fastbin_count = 0;
+}
+#endif
+
+/* Allocate a block of rounded size from arena. If dirty is not NULL it receives
+ * the number of leading data bytes that may be non-zero. Called with arena->lock held */
+static struct block_header_t* heap_malloc(struct arena_t* arena, uint64_t size, uint64_t* dirty) {
+    if (arena->heap == -1) {
+        heap_init();
+    }
+    if (arena->heap == -1 && segment_open(arena, size) != 0) {
+        return NULL;
+    }
+#ifdef MALLOC_DEFERRED_COALESCE
+    if (size < FASTBIN_MAX_SIZE) {
+        struct block_header_t* m_block = fastbin_get(arena, size);
+        if (m_block != NULL) {
+            if (dirty != NULL) {
+                *dirty = size;
+            }
+            return m_block;
+        }
+    }
+#endif
+    // Find block in free list
+    struct block_header_t* m_block = find_free_block(arena, size);
+#ifdef MALLOC_DEFERRED_COALESCE
+    if (m_block == NULL && arena->fastbin_count != 0) {
+        fastbin_consolidate(arena);
+        m_block = find_free_block(arena, size);
+    }
+#endif
+    if (m_block != NULL) {
+        allocate_free_block(arena, m_block, size);
+        if (dirty != NULL) {
+            *dirty = get_size(m_block);
+        }
+        return m_block;
+    }
+    struct block_header_t* next_block = next_available_block(arena);
+    if (arena->last != NULL && is_free(arena->last)) {
+        // Grow the free tail block rather than leaving it behind
+        next_block = arena->last;
+    }
+    char* block_end = (char*)next_block + BLOCK_OVERHEAD + size;
+    if (block_end + SENTINEL_SIZE > arena->heap_end && Sbrk(arena, block_end + SENTINEL_SIZE - arena->heap_end) == 1) {
+        // The segment cannot grow, so the block starts a new one
+        if (segment_open(arena, size) != 0) {
+            return NULL;
+        }
+        next_block = arena->heap;
+    }
+    if (next_block == arena->last) {
+        remove_from_free_list(arena, next_block);
+        set_block_size(next_block, size);
+    } else {
+        next_block->size = size;
+    }
+    if (dirty != NULL) {
+        char* data = data_addr(next_block);
+        *dirty = arena->clean > data ? arena->clean - data : 0;
+    }
+    claim_clean(arena, next_block);
+    if (arena->first == NULL) {
+        arena->first = next_block;
+    }
+    arena->last = next_block;
+    return next_block;
+}
+
+/* Free a block handed back by the caller, deferring the coalescing of small
+ * blocks when built with MALLOC_DEFERRED_COALESCE. Called with arena->lock held */
+static inline void arena_free(struct arena_t* arena, struct block_header_t* m_block) {
+    harden_check_prev(m_block);
+#ifdef MALLOC_DEFERRED_COALESCE
+    if (get_size(m_block) < FASTBIN_MAX_SIZE) {
+        fastbin_put(arena, m_block);
+        if (arena->fastbin_count >= FASTBIN_CONSOLIDATE_COUNT) {
+            fastbin_consolidate(arena);
+        }
+        return;
+    }
+#endif
+    heap_free(arena, m_block);
+}
+
+/* Split size bytes off the front of a used block and free the rest if it is
+ * large enough for a block of its own. Called with arena->lock held */
+static void shrink_block(struct arena_t* arena, struct block_header_t* m_block, uint64_t size) {
+    uint64_t block_size = get_size(m_block);
+    if (block_size - size < MINIMUM_BLOCK_SIZE) {
+        return;
+    }
+    set_block_size(m_block, size);
+    struct block_header_t* new_block = next_adjacent(m_block);
+    new_block->size = block_size - size - BLOCK_OVERHEAD;
+    if (m_block == arena->last) {
+        arena->last = new_block;
+    }
+    heap_free(arena, new_block);
+}
+
+/* Resize a used block in place by absorbing a free next block or growing the
+ * heap past the tail. Returns 1 on success, 0 if the block must move.
+ * Called with arena->lock held */
+static char heap_resize(struct arena_t* arena, struct block_header_t* m_block, uint64_t size) {
+    if (get_size(m_block) < size && m_block != arena->last) {
+        struct block_header_t* next_block = next_adjacent(m_block);
+        uint64_t merged = get_size(m_block) + BLOCK_OVERHEAD + get_size(next_block);
+        if (is_free(next_block) && merged < size && next_block == arena->last) {
+            // Grow the heap before absorbing the tail, so a failure leaves both blocks as they were
+            char* block_end = (char*)m_block + BLOCK_OVERHEAD + size;
+            if (block_end + SENTINEL_SIZE > arena->heap_end && Sbrk(arena, block_end + SENTINEL_SIZE - arena->heap_end) == 1) {
+                return 0;
+            }
+        }
+        if (is_free(next_block) && (merged >= size || next_block == arena->last)) {
+            remove_from_free_list(arena, next_block);
+            if (next_block == arena->last) {
+                arena->last = m_block;
+            }
+            set_block_size(m_block, get_size(m_block) + BLOCK_OVERHEAD + get_size(next_block));
+        }
+    }
+    if (get_size(m_block) < size && m_block == arena->last) {
+        char* block_end = (char*)m_block + BLOCK_OVERHEAD + size;
+        if (block_end + SENTINEL_SIZE > arena->heap_end && Sbrk(arena, block_end + SENTINEL_SIZE - arena->heap_end) == 1) {
+            return 0;
+        }
+        set_block_size(m_block, size);
+        claim_clean(arena, m_block);
+    }
+    if (get_size(m_block) < size) {
+        return 0;
+    }
+    shrink_block(arena, m_block, size);
+    return 1;
+}
+
+/* returns length of the mapping mmap_malloc makes for size bytes with alignment slack */
+static inline uint64_t mmap_length(uint64_t size, uint64_t slack) {
+    return (size + 2 * sizeof(uint64_t) + slack + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+/* Serve a large request with its own mapping, with data aligned to alignment.
+ * The word before the header holds the header's offset from the start of the mapping */
+static struct block_header_t* mmap_malloc(uint64_t size, uint64_t alignment) {
+#ifdef MALLOC_HARDENED
+    // Large requests skip the arenas, so the canary key may not be drawn yet
+    pthread_once(&init_once, init);
+#endif
+    uint64_t slack = alignment > MALLOC_ALIGNMENT ? alignment : 0;
+    uint64_t length = mmap_length(size, slack);
+    char* region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    char* data = region + 2 * sizeof(uint64_t);
+    if (slack != 0) {
+        data = (char*)(((uintptr_t)data + alignment - 1) & -alignment);
+    }
+    struct block_header_t* m_block = (struct block_header_t*)head_addr(data);
+    uint64_t offset = (char*)m_block - region;
+    ((uint64_t*)m_block)[-1] = offset;
+    m_block->size = (length - offset - sizeof(uint64_t)) | MMAPPED_BIT;
+    __atomic_add_fetch(&mmap_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mmap_bytes, length, __ATOMIC_RELAXED);
+    return m_block;
+}
+
+/* Unmap a block served by mmap_malloc */
+static void mmap_free(struct block_header_t* m_block) {
+    uint64_t offset = ((uint64_t*)m_block)[-1];
+    uint64_t length = offset + sizeof(uint64_t) + get_size(m_block);
+    __atomic_sub_fetch(&mmap_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mmap_bytes, length, __ATOMIC_RELAXED);
+    munmap((char*)m_block - offset, length);
+}
+
+/* Resize a block served by mmap_malloc with mremap. Returns NULL on failure */
+static struct block_header_t* mmap_resize(struct block_header_t* m_block, uint64_t size) {
+    uint64_t offset = ((uint64_t*)m_block)[-1];
+    uint64_t old_length = offset + sizeof(uint64_t) + get_size(m_block);
+    uint64_t length = (offset + sizeof(uint64_t) + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (length == old_length) {
+        return m_block;
+    }
+    char* region = mremap((char*)m_block - offset, old_length, length, MREMAP_MAYMOVE);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    m_block = (struct block_header_t*)(region + offset);
+    m_block->size = (length - offset - sizeof(uint64_t)) | MMAPPED_BIT;
+    __atomic_add_fetch(&mmap_bytes, length - old_length, __ATOMIC_RELAXED);
+    return m_block;
+}
+
+/* returns run holding slab slot */
+static inline struct slab_run_t* slab_run_of(void* ptr) {
+    return (struct slab_run_t*)((uintptr_t)ptr & ~(SLAB_RUN_SIZE - 1));
+}
+
+/* Take an empty run for arena, reserving the slab region on first use. Returns NULL when exhausted */
+static struct slab_run_t* slab_run_create(struct arena_t* arena, unsigned int class_index) {
+    pthread_mutex_lock(&slab_lock);
+    // A run that still has its pages is cheaper to take than one that faults them back in
+    struct slab_run_t** list = dirty_runs != NULL ? &dirty_runs : &free_runs;
+    struct slab_run_t* run = *list;
+    if (run != NULL) {
+        *list = run->next;
+    } else {
+        if (slab_region == NULL) {
+            char* region = mmap(NULL, SLAB_REGION_SIZE + SLAB_RUN_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (region != MAP_FAILED) {
+                slab_next = (char*)(((uintptr_t)region + SLAB_RUN_SIZE - 1) & ~(SLAB_RUN_SIZE - 1));
+                slab_region = slab_next;
+                __atomic_store_n(&slab_region_end, slab_region + SLAB_REGION_SIZE, __ATOMIC_RELEASE);
+            }
+        }
+        if (slab_next != NULL && slab_next < slab_region_end
+        && mprotect(slab_next, SLAB_RUN_SIZE, PROT_READ | PROT_WRITE) == 0) {
+            run = (struct slab_run_t*)slab_next;
+            slab_next += SLAB_RUN_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&slab_lock);
+    if (run == NULL) {
+        return NULL;
+    }
+    if (arena->node >= 0) {
+        numa_bind(run, SLAB_RUN_SIZE, arena->node);
+    }
+    run->arena = arena;
+    run->next = NULL;
+    run->prev = NULL;
+    run->free_slots = NULL;
+    run->slot_size = slab_class_sizes[class_index];
+    run->class_index = class_index;
+    run->nslots = (SLAB_RUN_SIZE - SLAB_RUN_HEADER_SIZE) / run->slot_size;
+    run->nfree = run->nslots;
+    run->bump = 0;
+    arena->slab_runs[class_index] = run;
+    return run;
+}
+
+/* Hand out one slot of class from arena, or NULL if no run can be had. Called with arena->lock held */
+static void* slab_malloc(struct arena_t* arena, unsigned int class_index) {
+    struct slab_run_t* run = arena->slab_runs[class_index];
+    if (run == NULL) {
+        run = slab_run_create(arena, class_index);
+        if (run == NULL) {
+            return NULL;
+        }
+    }
+    void* slot = run->free_slots;
+    if (slot != NULL) {
+        run->free_slots = REVEAL_LINK(*(void**)slot);
+        harden_check_slot_link(run->free_slots);
+    } else {
+        slot = (char*)run + SLAB_RUN_HEADER_SIZE + (uint64_t)run->bump * run->slot_size;
+        run->bump++;
+    }
+    run->nfree--;
+    if (run->nfree == 0) {
+        // Full runs leave the list until a slot comes back
+        arena->slab_runs[class_index] = run->next;
+        if (run->next != NULL) {
+            run->next->prev = NULL;
+        }
+        run->next = NULL;
+    }
+    return slot;
+}
+
+/* Give a slot back to its run. Called with the owning arena's lock held */
+static void slab_free(struct arena_t* arena, void* slot) {
+    struct slab_run_t* run = slab_run_of(slot);
+    SET_LINK(*(void**)slot, run->free_slots);
+    run->free_slots = slot;
+    run->nfree++;
+    if (run->nfree == 1) {
+        run->next = arena->slab_runs[run->class_index];
+        run->prev = NULL;
+        if (run->next != NULL) {
+            run->next->prev = run;
+        }
+        arena->slab_runs[run->class_index] = run;
+    } else if (run->nfree == run->nslots && (run->prev != NULL || run->next != NULL)) {
+        // Empty and not the last run of its class: release its pages and recycle it
+        if (run->prev != NULL) {
+            run->prev->next = run->next;
+        } else {
+            arena->slab_runs[run->class_index] = run->next;
+        }
+        if (run->next != NULL) {
+            run->next->prev = run->prev;
+        }
+        if (__atomic_load_n(&decay_time, __ATOMIC_RELAXED) != 0) {
+            // The decay thread releases the pages, unless a new run takes it first
+            run->freed_at = __atomic_load_n(&decay_clock, __ATOMIC_RELAXED);
+            pthread_mutex_lock(&slab_lock);
+            run->next = dirty_runs;
+            dirty_runs = run;
+            pthread_mutex_unlock(&slab_lock);
+            return;
+        }
+        madvise((char*)run + PAGE_SIZE, SLAB_RUN_SIZE - PAGE_SIZE, MADV_DONTNEED);
+        pthread_mutex_lock(&slab_lock);
+        run->next = free_runs;
+        free_runs = run;
+        pthread_mutex_unlock(&slab_lock);
+    }
+}
+
+/* Release the pages of the runs on dirty_runs that emptied at least age ms before
+ * now, or of all of them if age is 0, and move them to free_runs. Returns 1 if any
+ * run was released, 0 otherwise */
+static char slab_runs_purge(uint32_t now, uint64_t age) {
+    pthread_mutex_lock(&slab_lock);
+    // Runs are pushed as they empty, so the old ones form the tail
+    struct slab_run_t** link = &dirty_runs;
+    while (*link != NULL && age != 0 && now - (*link)->freed_at < age) {
+        link = &(*link)->next;
+    }
+    struct slab_run_t* chain = *link;
+    *link = NULL;
+    pthread_mutex_unlock(&slab_lock);
+    if (chain == NULL) {
+        return 0;
+    }
+    struct slab_run_t* last = chain;
+    for (;;) {
+        madvise((char*)last + PAGE_SIZE, SLAB_RUN_SIZE - PAGE_SIZE, MADV_DONTNEED);
+        if (last->next == NULL) {
+            break;
+        }
+        last = last->next;
+    }
+    pthread_mutex_lock(&slab_lock);
+    last->next = free_runs;
+    free_runs = chain;
+    pthread_mutex_unlock(&slab_lock);
+    return 1;
+}
+
+/* Hand a block owned by another arena to its remote free list with one CAS.
+ * chain_end is ptr itself, or the last block of a chain starting at ptr */
+static inline void remote_free(struct arena_t* arena, void* ptr, void* chain_end) {
+    void* head = __atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED);
+    do {
+        SET_LINK(*(void**)chain_end, head);
+    } while (!__atomic_compare_exchange_n(&arena->remote_free, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Free every block other threads handed to arena. Called with arena->lock held */
+static void remote_drain(struct arena_t* arena) {
+    void* chain = __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (chain != NULL) {
+        void* ptr = chain;
+        chain = REVEAL_LINK(*(void**)ptr);
+        if (is_slab(ptr)) {
+            slab_free(arena, ptr);
+        } else {
+            // Checked when queued, but a block may have been queued twice
+            harden_check_block((struct block_header_t*)head_addr(ptr));
+            arena_free(arena, (struct block_header_t*)head_addr(ptr));
+        }
+    }
+}
+
+/* Drain the remote free list of arena if anything is waiting. Called with arena->lock held */
+static inline void remote_poll(struct arena_t* arena) {
+    if (__atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED) != NULL) {
+        remote_drain(arena);
+    }
+}
+
+/* True when blocks of arena should go through its remote free list. The main arena
+ * serves fallbacks for every thread and may have no owner polling it, and an arena
+ * whose threads have all exited has none, so those always take the lock */
+static inline char is_remote(struct arena_t* arena) {
+    return arena != thread_arena && arena != &main_arena && __atomic_load_n(&arena->threads, __ATOMIC_RELAXED) != 0;
+}
+
+/* Free a chain of slots linked through their first word. Slots of other threads' arenas go to
+ * their remote lists, the rest are freed taking each owner's lock once per run of slots it owns */
+static void free_chain(void* chain) {
+    struct arena_t* locked = NULL;
+    while (chain != NULL) {
+        void* slot = chain;
+        chain = REVEAL_LINK(*(void**)slot);
+        struct arena_t* arena = slab_run_of(slot)->arena;
+        numa_count_free(arena, 1);
+        if (is_remote(arena)) {
+            remote_free(arena, slot, slot);
+            continue;
+        }
+        if (arena != locked) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&arena->lock);
+            remote_poll(arena);
+            locked = arena;
+        }
+        slab_free(arena, slot);
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+/* Give every cached slot back to its arena. Runs as the tcache_key destructor on thread exit */
+static void tcache_flush(void* unused) {
+    (void)unused;
+    for (unsigned int index = 0; index < TCACHE_BINS; index++) {
+        free_chain(tcache.entries[index]);
+        tcache.entries[index] = NULL;
+        tcache.counts[index] = 0;
+    }
+    tcache.registered = 0;
+}
+
+static void tcache_key_create() {
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+
+/* Arm the destructor that flushes this thread's cache when it exits */
+static void tcache_register() {
+    pthread_once(&tcache_key_once, tcache_key_create);
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = 1;
+}
+
+/* Push slot onto this thread's cache */
+static inline void tcache_put(void* slot, unsigned int index) {
+    SET_LINK(*(void**)slot, tcache.entries[index]);
+    tcache.entries[index] = slot;
+    tcache.counts[index]++;
+}
+
+/* Pop a slot off this thread's cache, or NULL if the bin is empty */
+static inline void* tcache_get(unsigned int index) {
+    void* slot = tcache.entries[index];
+    if (slot != NULL) {
+        tcache.entries[index] = REVEAL_LINK(*(void**)slot);
+        tcache.counts[index]--;
+        harden_check_slot_link(tcache.entries[index]);
+    }
+    return slot;
+}
+
+/* Serve a small request from the thread cache, refilling it from the thread's arena on a miss */
+static void* small_malloc(unsigned int index) {
+    void* slot = tcache_get(index);
+    if (slot != NULL) {
+        return slot;
+    }
+    if (!tcache.registered) {
+        tcache_register();
+    }
+    struct arena_t* arena = local_arena();
+    // Refill the cache while holding the lock so the next few calls stay local
+    pthread_mutex_lock(&arena->lock);
+    remote_poll(arena);
+    slot = slab_malloc(arena, index);
+    uint32_t fill = __atomic_load_n(&tcache_fill_count, __ATOMIC_RELAXED);
+    for (uint32_t i = 1; slot != NULL && i < fill; i++) {
+        void* extra = slab_malloc(arena, index);
+        if (extra == NULL) {
+            break;
+        }
+        tcache_put(extra, index);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return slot;
+}
+
+/* Free a slab slot of class index through the thread cache, handing half of a full bin back to the arenas */
+static void small_free(void* slot, unsigned int index) {
+    stats_free(1, slab_class_sizes[index]);
+    uint32_t max_count = __atomic_load_n(&tcache_max_count, __ATOMIC_RELAXED);
+    if (tcache.counts[index] < max_count) {
+        if (!tcache.registered) {
+            tcache_register();
+        }
+        tcache_put(slot, index);
+        return;
+    }
+    void* chain = slot;
+    SET_LINK(*(void**)slot, NULL);
+    while (tcache.counts[index] > max_count / 2) {
+        void* cached = tcache_get(index);
+        SET_LINK(*(void**)cached, chain);
+        chain = cached;
+    }
+    free_chain(chain);
+}
+
+/* Allocate a heap block of rounded size from the calling thread's arena,
+ * falling back to the main arena and then to a mapping of its own. dirty is
+ * passed on to heap_malloc */
+static struct block_header_t* arena_malloc(uint64_t size, uint64_t* dirty) {
+    struct arena_t* arena = local_arena();
+    pthread_mutex_lock(&arena->lock);
+    remote_poll(arena);
+    struct block_header_t* m_block = heap_malloc(arena, size, dirty);
+    pthread_mutex_unlock(&arena->lock);
+    if (m_block == NULL && arena != &main_arena) {
+        // No segment could be had, fall back to the main arena
+        pthread_mutex_lock(&main_arena.lock);
+        m_block = heap_malloc(&main_arena, size, dirty);
+        pthread_mutex_unlock(&main_arena.lock);
+    }
+    if (m_block == NULL) {
+        // Too large for a segment, or address space is short
+        m_block = mmap_malloc(size, MALLOC_ALIGNMENT);
+        if (m_block != NULL && dirty != NULL) {
+            *dirty = 0;
+        }
+    }
+    return m_block;
+}
+
+void* Malloc(uint64_t size) {
+    if (size > MAX_ALLOC_SIZE) {
+        return NULL;
+    }
+    if (size <= SLAB_MAX_SIZE) {
+        unsigned int index = slab_class_of[(size + 15) >> 4];
+        void* slot = small_malloc(index);
+        if (slot != NULL) {
+            harden_alloc_slot(slot);
+            stats_malloc(1, slab_class_sizes[index]);
+            profile_malloc(slot, size);
+            trace_record(MALLOC_TRACE_MALLOC, slot, size, 0);
+            return slot;
+        }
+        // Slab region is exhausted, fall back to a heap block
+    }
+    uint64_t rounded = request_size(size);
+    struct block_header_t* m_block;
+    if (rounded >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        m_block = mmap_malloc(rounded, MALLOC_ALIGNMENT);
+    } else {
+        m_block = arena_malloc(rounded, NULL);
+    }
+    if (m_block == NULL) {
+        return NULL;
+    }
+    harden_set_canary(m_block);
+    stats_malloc(1, get_size(m_block));
+    profile_malloc(data_addr(m_block), size);
+    trace_record(MALLOC_TRACE_MALLOC, data_addr(m_block), size, 0);
+    return data_addr(m_block);
+}
+
+void* MallocOnNode(uint64_t size, int node) {
+    pthread_once(&init_once, init);
+    if (node < 0 || (unsigned int)node >= numa_nodes || size > MAX_ALLOC_SIZE) {
+        return NULL;
+    }
+    if (numa_nodes == 1) {
+        return Malloc(size);
+    }
+    uint64_t rounded = request_size(size);
+    struct block_header_t* m_block = NULL;
+    if (rounded < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        // Take a heap block from one of the node's arenas, never through the thread cache
+        struct arena_t* arena = thread_arena;
+        if (arena == NULL || arena->node != node) {
+            arena = arena_get(numa_arena_index(node, __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED)));
+        }
+        if (arena->node == node) {
+            pthread_mutex_lock(&arena->lock);
+            remote_poll(arena);
+            m_block = heap_malloc(arena, rounded, NULL);
+            pthread_mutex_unlock(&arena->lock);
+        }
+    }
+    if (m_block == NULL) {
+        // Too large, or the node has no arena with room: bind a mapping of its own
+        m_block = mmap_malloc(rounded, MALLOC_ALIGNMENT);
+        if (m_block == NULL) {
+            return NULL;
+        }
+        uint64_t offset = ((uint64_t*)m_block)[-1];
+        numa_bind((char*)m_block - offset, offset + sizeof(uint64_t) + get_size(m_block), node);
+    }
+    harden_set_canary(m_block);
+    stats_malloc(1, get_size(m_block));
+    profile_malloc(data_addr(m_block), size);
+    trace_record(MALLOC_TRACE_MALLOC, data_addr(m_block), size, 0);
+    return data_addr(m_block);
+}
+
+/* Allocate a heap block whose data is aligned to alignment, a power of two above
+ * MALLOC_ALIGNMENT. The leading slack is split off as a free block of its own */
+static struct block_header_t* heap_memalign(uint64_t alignment, uint64_t size) {
+    struct arena_t* arena = local_arena();
+    pthread_mutex_lock(&arena->lock);
+    remote_poll(arena);
+    struct block_header_t* m_block = heap_malloc(arena, size + alignment + MINIMUM_BLOCK_SIZE, NULL);
+    if (m_block == NULL) {
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+    char* data = data_addr(m_block);
+    if (((uintptr_t)data & (alignment - 1)) != 0) {
+        // Leave room for a whole free block in front of the aligned one
+        char* aligned = (char*)(((uintptr_t)data + MINIMUM_BLOCK_SIZE + alignment - 1) & -alignment);
+        struct block_header_t* aligned_block = (struct block_header_t*)head_addr(aligned);
+        aligned_block->size = get_size(m_block) - (aligned - data);
+        set_block_size(m_block, aligned - data - BLOCK_OVERHEAD);
+        if (m_block == arena->last) {
+            arena->last = aligned_block;
+        }
+        heap_free(arena, m_block);
+        m_block = aligned_block;
+    }
+    shrink_block(arena, m_block, size);
+    pthread_mutex_unlock(&arena->lock);
+    return m_block;
+}
+
+void* Memalign(uint64_t alignment, uint64_t size) {
+    if ((alignment & (alignment - 1)) != 0 || size > MAX_ALLOC_SIZE - alignment) {
+        return NULL;
+    }
+    if (alignment <= MALLOC_ALIGNMENT) {
+        return Malloc(size);
+    }
+    uint64_t rounded = request_size(size);
+    struct block_header_t* m_block;
+    if (rounded + alignment >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        m_block = mmap_malloc(rounded, alignment);
+    } else {
+        m_block = heap_memalign(alignment, rounded);
+    }
+    if (m_block == NULL) {
+        return NULL;
+    }
+    harden_set_canary(m_block);
+    stats_malloc(1, get_size(m_block));
+    profile_malloc(data_addr(m_block), size);
+    trace_record(MALLOC_TRACE_MEMALIGN, data_addr(m_block), size, alignment);
+    return data_addr(m_block);
+}
+
+int PosixMemalign(void** memptr, uint64_t alignment, uint64_t size) {
+    if ((alignment & (alignment - 1)) != 0 || alignment < sizeof(void*)) {
+        return EINVAL;
+    }
+    void* ptr = Memalign(alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void* AlignedAlloc(uint64_t alignment, uint64_t size) {
+    return Memalign(alignment, size);
+}
+
+void* Calloc(uint64_t count, uint64_t size) {
+    uint64_t total;
+    if (__builtin_mul_overflow(count, size, &total) || total > MAX_ALLOC_SIZE) {
+        return NULL;
+    }
+    if (total <= SLAB_MAX_SIZE) {
+        trace_mute();
+        void* ptr = Malloc(total);
+        trace_unmute();
+        if (ptr != NULL) {
+            memset(ptr, 0, total);
+            trace_record(MALLOC_TRACE_CALLOC, ptr, total, 0);
+        }
+        return ptr;
+    }
+    uint64_t rounded = request_size(total);
+    if (rounded >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        // Fresh mappings are zero filled by the kernel
+        struct block_header_t* m_block = mmap_malloc(rounded, MALLOC_ALIGNMENT);
+        if (m_block == NULL) {
+            return NULL;
+        }
+        harden_set_canary(m_block);
+        stats_malloc(1, get_size(m_block));
+        profile_malloc(data_addr(m_block), total);
+        trace_record(MALLOC_TRACE_CALLOC, data_addr(m_block), total, 0);
+        return data_addr(m_block);
+    }
+    uint64_t dirty;
+    struct block_header_t* m_block = arena_malloc(rounded, &dirty);
+    if (m_block == NULL) {
+        return NULL;
+    }
+    harden_set_canary(m_block);
+    stats_malloc(1, get_size(m_block));
+    profile_malloc(data_addr(m_block), total);
+    trace_record(MALLOC_TRACE_CALLOC, data_addr(m_block), total, 0);
+    // Only the part not carved from never written heap space needs clearing
+    memset(data_addr(m_block), 0, dirty < total ? dirty : total);
+    return data_addr(m_block);
+}
+
+void Free(void* p) {
+    if (p == 0) {
+        return;
+    }
+    profile_free(p);
+    trace_record(MALLOC_TRACE_FREE, p, 0, 0);
+    if (is_slab(p)) {
+        harden_free_slot(p);
+        small_free(p, slab_run_of(p)->class_index);
+        return;
+    }
+    char* ptr = p;
+    struct block_header_t* m_block = head_addr(ptr);
+    harden_check_block(m_block);
+    stats_free(1, get_size(m_block));
+    if (is_mmapped(m_block)) {
+        mmap_free(m_block);
+        return;
+    }
+    struct arena_t* arena = arena_of(m_block);
+    numa_count_free(arena, 1);
+    if (is_remote(arena)) {
+        // Not ours: queue it for the owner instead of contending on its lock
+        remote_free(arena, p, p);
+        return;
+    }
+    pthread_mutex_lock(&arena->lock);
+    // Frees queued while the arena's last thread was leaving are picked up here
+    remote_poll(arena);
+    arena_free(arena, m_block);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void FreeSized(void* p, uint64_t size) {
+    if (p == 0) {
+        return;
+    }
+    if (size <= SLAB_MAX_SIZE && is_slab(p)) {
+        // The class comes from size alone, so neither the slot nor its run header is read
+        unsigned int index = slab_class_of[(size + 15) >> 4];
+#ifdef MALLOC_DEBUG
+        if (slab_run_of(p)->class_index != index) {
+            malloc_fatal("FreeSized: size does not match the allocation");
+        }
+#endif
+        profile_free(p);
+        trace_record(MALLOC_TRACE_FREE, p, 0, 0);
+        harden_free_slot(p);
+        small_free(p, index);
+        return;
+    }
+#ifdef MALLOC_DEBUG
+    if (!is_slab(p) && size > get_size((struct block_header_t*)head_addr(p)) - CANARY_SIZE) {
+        malloc_fatal("FreeSized: size does not match the allocation");
+    }
+#endif
+    Free(p);
+}
+
+/* Carve k blocks of rounded size out of one heap allocation, storing their data in out and
+ * adding their usable bytes to bytes. Returns the number stored, which is 0 if arena has no
+ * room. Called with arena->lock held */
+static uint64_t heap_malloc_batch(struct arena_t* arena, uint64_t size, uint64_t k, void** out, uint64_t* bytes) {
+    struct block_header_t* m_block = heap_malloc(arena, k * (size + BLOCK_OVERHEAD) - BLOCK_OVERHEAD, NULL);
+    if (m_block == NULL) {
+        return 0;
+    }
+    // The last block keeps any slack the allocation came with
+    uint64_t last_size = get_size(m_block) - (k - 1) * (size + BLOCK_OVERHEAD);
+    char was_last = m_block == arena->last;
+    set_block_size(m_block, k == 1 ? last_size : size);
+    out[0] = data_addr(m_block);
+    for (uint64_t i = 1; i < k; i++) {
+        m_block = next_adjacent(m_block);
+        m_block->size = i == k - 1 ? last_size : size;
+        out[i] = data_addr(m_block);
+    }
+    if (was_last) {
+        arena->last = m_block;
+    }
+    *bytes += (k - 1) * size + last_size;
+    return k;
+}
+
+/* MallocBatch without the trace records */
+static uint64_t malloc_batch(uint64_t size, uint64_t n, void** out) {
+    if (size > MAX_ALLOC_SIZE) {
+        return 0;
+    }
+    uint64_t count = 0;
+    struct arena_t* arena = local_arena();
+    if (size <= SLAB_MAX_SIZE) {
+        unsigned int index = slab_class_of[(size + 15) >> 4];
+        while (count < n && tcache.entries[index] != NULL) {
+            out[count++] = tcache_get(index);
+        }
+        stats_malloc(count, count * slab_class_sizes[index]);
+        if (count == n) {
+            return count;
+        }
+        uint64_t cached = count;
+        pthread_mutex_lock(&arena->lock);
+        remote_poll(arena);
+        for (void* slot; count < n && (slot = slab_malloc(arena, index)) != NULL; ) {
+            out[count++] = slot;
+        }
+        pthread_mutex_unlock(&arena->lock);
+        stats_malloc(count - cached, (count - cached) * slab_class_sizes[index]);
+        // Slab region is exhausted, fall back to heap blocks
+    }
+    size = request_size(size);
+    uint64_t threshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+    if (size >= threshold) {
+        for (struct block_header_t* m_block; count < n && (m_block = mmap_malloc(size, MALLOC_ALIGNMENT)) != NULL; ) {
+            stats_malloc(1, get_size(m_block));
+            out[count++] = data_addr(m_block);
+        }
+        return count;
+    }
+    // Carve at most a threshold's worth per allocation so one batch does not pin a huge free block
+    uint64_t per_carve = threshold / (size + BLOCK_OVERHEAD);
+    if (per_carve == 0) {
+        per_carve = 1;
+    }
+    // Counted once the locks are dropped, since the first count of a thread allocates
+    uint64_t first = count;
+    uint64_t bytes = 0;
+    pthread_mutex_lock(&arena->lock);
+    remote_poll(arena);
+    while (count < n) {
+        uint64_t k = n - count < per_carve ? n - count : per_carve;
+        uint64_t carved = heap_malloc_batch(arena, size, k, out + count, &bytes);
+        if (carved == 0 && k > 1) {
+            // No room for the whole run, try one block at a time
+            per_carve = 1;
+            continue;
+        }
+        if (carved == 0) {
+            break;
+        }
+        count += carved;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    if (count < n && arena != &main_arena) {
+        pthread_mutex_lock(&main_arena.lock);
+        while (count < n && heap_malloc_batch(&main_arena, size, 1, out + count, &bytes) != 0) {
+            count++;
+        }
+        pthread_mutex_unlock(&main_arena.lock);
+    }
+    stats_malloc(count - first, bytes);
+    return count;
+}
+
+uint64_t MallocBatch(uint64_t size, uint64_t n, void** out) {
+    uint64_t count = malloc_batch(size, n, out);
+    for (uint64_t i = 0; i < count; i++) {
+#ifdef MALLOC_HARDENED
+        if (is_slab(out[i])) {
+            harden_alloc_slot(out[i]);
+        } else {
+            harden_set_canary((struct block_header_t*)head_addr(out[i]));
+        }
+#endif
+        profile_malloc(out[i], size);
+        trace_record(MALLOC_TRACE_MALLOC, out[i], size, 0);
+    }
+    return count;
+}
+
+void FreeBatch(void** ptrs, uint64_t n) {
+    struct arena_t* locked = NULL;          /* local arena whose lock is held */
+    struct arena_t* remote = NULL;          /* owner of the pending remote chain */
+    void* chain = NULL;
+    void* chain_end = NULL;
+    for (uint64_t i = 0; i < n; i++) {
+        void* p = ptrs[i];
+        if (p == 0) {
+            continue;
+        }
+        profile_free(p);
+        trace_record(MALLOC_TRACE_FREE, p, 0, 0);
+        if (is_slab(p)) {
+            // A full cache bin flushes through free_chain, which takes the arena lock itself
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+                locked = NULL;
+            }
+            harden_free_slot(p);
+            small_free(p, slab_run_of(p)->class_index);
+            continue;
+        }
+        struct block_header_t* m_block = (struct block_header_t*)head_addr(p);
+        harden_check_block(m_block);
+        stats_free(1, get_size(m_block));
+        if (is_mmapped(m_block)) {
+            mmap_free(m_block);
+            continue;
+        }
+        struct arena_t* arena = arena_of(m_block);
+        numa_count_free(arena, 1);
+        if (is_remote(arena)) {
+            // Pre-link blocks bound for the same owner and push them with one CAS
+            if (arena != remote && chain != NULL) {
+                remote_free(remote, chain, chain_end);
+                chain = NULL;
+            }
+            if (chain == NULL) {
+                chain_end = p;
+            }
+            SET_LINK(*(void**)p, chain);
+            chain = p;
+            remote = arena;
+            continue;
+        }
+        if (arena != locked) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&arena->lock);
+            remote_poll(arena);
+            locked = arena;
+        }
+        arena_free(arena, m_block);
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    if (chain != NULL) {
+        remote_free(remote, chain, chain_end);
+    }
+}
+
+/* Realloc without the trace record */
+static void* realloc_block(void* p, uint64_t size) {
+    if (p == 0) {
+        return Malloc(size);
+    }
+    if (size == 0) {
+        Free(p);
+        return NULL;
+    }
+    if (size > MAX_ALLOC_SIZE) {
+        return NULL;
+    }
+    uint64_t old_size;
+    if (is_slab(p)) {
+        struct slab_run_t* run = slab_run_of(p);
+        harden_check_slot(p);
+        old_size = run->slot_size;
+        // Keep the slot only while size maps to its class, so FreeSized(p, size) stays correct
+        if (size <= old_size && slab_class_of[(size + 15) >> 4] == run->class_index) {
+            return p;
+        }
+    } else {
+        struct block_header_t* m_block = head_addr(p);
+        uint64_t rounded = request_size(size);
+        harden_check_block(m_block);
+        old_size = get_size(m_block);
+        if (is_mmapped(m_block)) {
+            struct block_header_t* resized = mmap_resize(m_block, rounded);
+            if (resized == NULL) {
+                return NULL;
+            }
+            harden_set_canary(resized);
+            stats_resize(old_size, get_size(resized));
+            return data_addr(resized);
+        }
+        struct arena_t* arena = arena_of(m_block);
+        pthread_mutex_lock(&arena->lock);
+        harden_check_prev(m_block);
+        char resized = heap_resize(arena, m_block, rounded);
+        pthread_mutex_unlock(&arena->lock);
+        if (resized) {
+            harden_set_canary(m_block);
+            stats_resize(old_size, get_size(m_block));
+            return p;
+        }
+    }
+    // Copy as a last resort
+    void* new_ptr = Malloc(size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, p, old_size < size ? old_size : size);
+    Free(p);
+    return new_ptr;
+}
+
+void* Realloc(void* p, uint64_t size) {
+    trace_mute();
+    void* new_ptr = realloc_block(p, size);
+    trace_unmute();
+    trace_record(MALLOC_TRACE_REALLOC, new_ptr, size, (uintptr_t)p);
+    return new_ptr;
+}
+
+uint64_t MallocUsableSize(void* p) {
+    if (p == 0) {
+        return 0;
+    }
+    if (is_slab(p)) {
+        return slab_run_of(p)->slot_size;
+    }
+    return get_size((struct block_header_t*)head_addr(p)) - CANARY_SIZE;
+}
+
+uint64_t MallocGoodSize(uint64_t size) {
+    if (size > MAX_ALLOC_SIZE) {
+        return 0;
+    }
+    if (size <= SLAB_MAX_SIZE) {
+        return slab_class_sizes[slab_class_of[(size + 15) >> 4]];
+    }
+    uint64_t rounded = request_size(size);
+    if (rounded >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        // The mapping holds the offset word and the header, the rest of its pages are data
+        return mmap_length(rounded, 0) - 2 * sizeof(uint64_t) - CANARY_SIZE;
+    }
+    return rounded - CANARY_SIZE;
+}
+
+/* Take a chunk from the freelist, mapping a new one if it is empty. Returns NULL when out of memory */
+static struct region_chunk_t* region_chunk_get() {
+    pthread_mutex_lock(&region_lock);
+    struct region_chunk_t* chunk = free_chunks;
+    if (chunk != NULL) {
+        free_chunks = chunk->next;
+    }
+    pthread_mutex_unlock(&region_lock);
+    if (chunk == NULL) {
+        chunk = mmap(NULL, REGION_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            return NULL;
+        }
+    }
+    chunk->next = NULL;
+    return chunk;
+}
+
+/* Put the chain of chunks from first to last back on the freelist */
+static void region_chunks_put(struct region_chunk_t* first, struct region_chunk_t* last) {
+    pthread_mutex_lock(&region_lock);
+    last->next = free_chunks;
+    free_chunks = first;
+    pthread_mutex_unlock(&region_lock);
+}
+
+/* Unmap the freelist. Returns 1 if any chunk was released, 0 otherwise */
+static char region_chunks_release() {
+    pthread_mutex_lock(&region_lock);
+    struct region_chunk_t* chunk = free_chunks;
+    free_chunks = NULL;
+    pthread_mutex_unlock(&region_lock);
+    char released = chunk != NULL;
+    while (chunk != NULL) {
+        struct region_chunk_t* next = chunk->next;
+        munmap(chunk, REGION_CHUNK_SIZE);
+        chunk = next;
+    }
+    return released;
+}
+
+/* Unmap the large allocations of region */
+static void region_free_large(struct region_t* region) {
+    while (region->large != NULL) {
+        char* data = region->large;
+        region->large = *(char**)data;
+        mmap_free((struct block_header_t*)head_addr(data));
+    }
+}
+
+struct region_t* RegionCreate() {
+    struct region_chunk_t* chunk = region_chunk_get();
+    if (chunk == NULL) {
+        return NULL;
+    }
+    struct region_t* region = (struct region_t*)(chunk + 1);
+    region->bump = (char*)(region + 1);
+    region->limit = (char*)chunk + REGION_CHUNK_SIZE;
+    region->chunks = NULL;
+    region->chunks_tail = NULL;
+    region->large = NULL;
+    return region;
+}
+
+void* RegionAlloc(struct region_t* region, uint64_t size) {
+    if (size > MAX_ALLOC_SIZE) {
+        return NULL;
+    }
+    size = round(size);
+    if (size <= (uint64_t)(region->limit - region->bump)) {
+        void* ptr = region->bump;
+        region->bump += size;
+        return ptr;
+    }
+    if (size > REGION_LARGE_SIZE) {
+        // The first 16 bytes link the allocation into region->large
+        struct block_header_t* m_block = mmap_malloc(size + MALLOC_ALIGNMENT, MALLOC_ALIGNMENT);
+        if (m_block == NULL) {
+            return NULL;
+        }
+        char* data = data_addr(m_block);
+        *(char**)data = region->large;
+        region->large = data;
+        return data + MALLOC_ALIGNMENT;
+    }
+    struct region_chunk_t* chunk = region_chunk_get();
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = region->chunks;
+    region->chunks = chunk;
+    if (region->chunks_tail == NULL) {
+        region->chunks_tail = chunk;
+    }
+    char* ptr = (char*)(chunk + 1);
+    region->bump = ptr + size;
+    region->limit = (char*)chunk + REGION_CHUNK_SIZE;
+    return ptr;
+}
+
+void RegionReset(struct region_t* region) {
+    if (region->chunks != NULL) {
+        region_chunks_put(region->chunks, region->chunks_tail);
+        region->chunks = NULL;
+        region->chunks_tail = NULL;
+    }
+    region_free_large(region);
+    region->bump = (char*)(region + 1);
+    region->limit = (char*)region - sizeof(struct region_chunk_t) + REGION_CHUNK_SIZE;
+}
+
+void RegionDestroy(struct region_t* region) {
+    region_free_large(region);
+    struct region_chunk_t* first = (struct region_chunk_t*)region - 1;
+    first->next = region->chunks;
+    region_chunks_put(first, region->chunks_tail != NULL ? region->chunks_tail : first);
+}
+
+int Trim() {
+    tcache_flush(NULL);
+    char released = 0;
+    for (unsigned int i = 0; i < MAX_ARENAS; i++) {
+        struct arena_t* arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+        if (arena == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&arena->lock);
+        remote_drain(arena);
+#ifdef MALLOC_DEFERRED_COALESCE
+        fastbin_consolidate(arena);
+#endif
+        released |= trim_arena(arena, 0);
+        // Only tree blocks are large enough to hold a whole page
+        for (struct tree_node_t* node = tree_next(arena, NULL); node != NULL; node = tree_next(arena, node)) {
+            released |= purge_free_block(arena, (struct block_header_t*)node, MADV_DONTNEED) > 0;
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    released |= slab_runs_purge(0, 0);
+    released |= region_chunks_release();
+    return released;
+}
+
+/* Age the tree blocks of arena by moving them along the decay curve, and trim
+ * its tail once it has been free for the whole decay time. Called with arena->lock held */
+static void decay_arena(struct arena_t* arena, uint32_t now, uint64_t decay) {
+    for (struct tree_node_t* node = tree_next(arena, NULL); node != NULL; node = tree_next(arena, node)) {
+        uint32_t age = now - node->freed_at;
+        if (node->decay_state != DECAY_RELEASED && age >= decay) {
+            purge_free_block(arena, (struct block_header_t*)node, MADV_DONTNEED);
+            node->decay_state = DECAY_RELEASED;
+        } else if (node->decay_state == DECAY_DIRTY && age >= decay / 2) {
+            // Kernels without MADV_FREE refuse it, so the pages go straight to released
+            if (purge_free_block(arena, (struct block_header_t*)node, MADV_FREE) < 0 && errno == EINVAL) {
+                purge_free_block(arena, (struct block_header_t*)node, MADV_DONTNEED);
+                node->decay_state = DECAY_RELEASED;
+            } else {
+                node->decay_state = DECAY_MUZZY;
+            }
+        }
+    }
+    struct block_header_t* tail = arena->last;
+    if (tail != NULL && is_free(tail) && get_size(tail) >= TREE_MIN_SIZE
+        && now - ((struct tree_node_t*)tail)->freed_at >= decay) {
+        trim_arena(arena, 0);
+    }
+}
+
+/* Advance decay_clock to the monotonic time in ms and return it */
+static uint32_t decay_tick() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint32_t now = (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+    __atomic_store_n(&decay_clock, now, __ATOMIC_RELAXED);
+    return now;
+}
+
+/* One pass of the decay thread over every arena */
+static void decay_pass(uint64_t decay) {
+    uint32_t now = decay_tick();
+    for (unsigned int i = 0; i < MAX_ARENAS; i++) {
+        struct arena_t* arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+        if (arena == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&arena->lock);
+        // Blocks waiting for an idle owner would otherwise never age
+        remote_drain(arena);
+#ifdef MALLOC_DEFERRED_COALESCE
+        fastbin_consolidate(arena);
+#endif
+        decay_arena(arena, now, decay);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    slab_runs_purge(now, decay);
+}
+
+/* Body of the decay thread. It sleeps while decay_time is 0 */
+static void* decay_thread(void* unused) {
+    (void)unused;
+    pthread_mutex_lock(&decay_lock);
+    for (;;) {
+        uint64_t decay = __atomic_load_n(&decay_time, __ATOMIC_RELAXED);
+        if (decay == 0) {
+            pthread_cond_wait(&decay_cond, &decay_lock);
+            continue;
+        }
+        uint64_t interval = decay / DECAY_STEPS > DECAY_MIN_INTERVAL ? decay / DECAY_STEPS : DECAY_MIN_INTERVAL;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval / 1000;
+        deadline.tv_nsec += (interval % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        // A changed decay time wakes the thread early, to start over with the new interval
+        if (pthread_cond_timedwait(&decay_cond, &decay_lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&decay_lock);
+            decay_pass(decay);
+            pthread_mutex_lock(&decay_lock);
+        }
+    }
+    return NULL;
+}
+
+/* The decay thread is gone in the child of a fork, start another */
+static void decay_fork_child() {
+    pthread_mutex_init(&decay_lock, NULL);
+    pthread_cond_init(&decay_cond, NULL);
+    __atomic_store_n(&decay_running, 0, __ATOMIC_RELAXED);
+    decay_start();
+}
+
+static void decay_atfork() {
+    pthread_atfork(NULL, NULL, decay_fork_child);
+}
+
+/* Start the decay thread unless it runs already. Must be called without an
+ * arena lock held, as creating a thread allocates */
+static void decay_start() {
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&decay_running, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_once(&decay_atfork_once, decay_atfork);
+    // Blocks freed from now on age from the present rather than from a clock at 0
+    decay_tick();
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    // Leave every signal to the program's own threads
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, decay_thread, NULL) != 0) {
+        __atomic_store_n(&decay_running, 0, __ATOMIC_RELAXED);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+#ifdef MALLOC_PROFILE
+int MallocProfileDump(int fd) {
+    return profile_dump(fd);
+}
+
+int MallocProfileSignal(int signo, int fd) {
+    profile_signal_fd = fd;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(signo, &action, NULL) == 0 ? 0 : -1;
+}
+#endif
+
+#ifdef MALLOC_TRACE
+int MallocTraceStart(const char* path) {
+    pthread_mutex_lock(&trace_lock);
+    int result = trace_fd >= 0 ? -1 : trace_open(path);
+    pthread_mutex_unlock(&trace_lock);
+    return result;
+}
+
+void MallocTraceStop() {
+    trace_close();
+}
+#endif
+
+int Mallopt(int param, uint64_t value) {
+    switch (param) {
+    case MALLOC_OPT_MMAP_THRESHOLD:
+        __atomic_store_n(&mmap_threshold, value, __ATOMIC_RELAXED);
+        return 0;
+    case MALLOC_OPT_TRIM_THRESHOLD:
+        __atomic_store_n(&trim_threshold, value, __ATOMIC_RELAXED);
+        return 0;
+#ifdef MALLOC_PROFILE
+    case MALLOC_OPT_PROFILE_INTERVAL:
+        __atomic_store_n(&profile_interval, value, __ATOMIC_RELAXED);
+        return 0;
+#endif
+    case MALLOC_OPT_HUGEPAGES:
+        if (value > MALLOC_HUGEPAGES_HUGETLB) {
+            return -1;
+        }
+        __atomic_store_n(&hugepages, value, __ATOMIC_RELAXED);
+        return 0;
+    case MALLOC_OPT_TCACHE_MAX:
+        __atomic_store_n(&tcache_max_count, value, __ATOMIC_RELAXED);
+        return 0;
+    case MALLOC_OPT_TCACHE_FILL:
+        if (value == 0) {
+            return -1;
+        }
+        __atomic_store_n(&tcache_fill_count, value, __ATOMIC_RELAXED);
+        return 0;
+    case MALLOC_OPT_DECAY_TIME:
+        if (value > UINT32_MAX / 2) {
+            // Ages are kept in 32 bits of milliseconds
+            return -1;
+        }
+        pthread_mutex_lock(&decay_lock);
+        __atomic_store_n(&decay_time, value, __ATOMIC_RELAXED);
+        pthread_cond_signal(&decay_cond);
+        pthread_mutex_unlock(&decay_lock);
+        if (value != 0 && __atomic_load_n(&narenas, __ATOMIC_ACQUIRE) != 0) {
+            decay_start();
+        }
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/* Add a free block of size bytes to the free block totals of stats */
+static inline void stats_count_free(struct malloc_stats* stats, uint64_t size) {
+    stats->free_bytes += size;
+    stats->free_blocks++;
+    if (size > stats->largest_free_block) {
+        stats->largest_free_block = size;
+    }
+    unsigned int bucket = 63 - __builtin_clzll(size | 1);
+    stats->free_histogram[bucket < MALLOC_STATS_BUCKETS ? bucket : MALLOC_STATS_BUCKETS - 1]++;
+}
+
+void MallocStats(struct malloc_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&stats_lock);
+    struct thread_stats_t totals = exited_stats;
+    for (struct thread_stats_t* thread = stats_threads; thread != NULL; thread = thread->next) {
+        totals.malloc_calls += __atomic_load_n(&thread->malloc_calls, __ATOMIC_RELAXED);
+        totals.free_calls += __atomic_load_n(&thread->free_calls, __ATOMIC_RELAXED);
+        totals.allocated_bytes += __atomic_load_n(&thread->allocated_bytes, __ATOMIC_RELAXED);
+        totals.freed_bytes += __atomic_load_n(&thread->freed_bytes, __ATOMIC_RELAXED);
+        totals.cross_node_frees += __atomic_load_n(&thread->cross_node_frees, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    stats->malloc_calls = totals.malloc_calls;
+    stats->free_calls = totals.free_calls;
+    stats->cross_node_frees = totals.cross_node_frees;
+    stats->numa_nodes = numa_nodes;
+    // Frees of blocks allocated by other threads can run ahead of the matching counts
+    stats->in_use_bytes = totals.allocated_bytes > totals.freed_bytes ? totals.allocated_bytes - totals.freed_bytes : 0;
+    for (unsigned int i = 0; i < MAX_ARENAS; i++) {
+        struct arena_t* arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+        if (arena == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&arena->lock);
+        // Queued and unmerged blocks would be counted as used, or as many small ones
+        remote_drain(arena);
+#ifdef MALLOC_DEFERRED_COALESCE
+        fastbin_consolidate(arena);
+#endif
+        if (arena->heap != (char*)-1) {
+            stats->heap_bytes += arena->heap_end - arena->heap;
+        }
+        for (struct heap_info_t* info = arena->segment; info != NULL && info->prev_heap != NULL; info = info->prev) {
+            stats->heap_bytes += info->prev_heap_end - info->prev_heap;
+        }
+        stats->sbrk_calls += arena->sbrk_calls;
+        for (unsigned int bin = 0; bin < NUM_BINS; bin++) {
+            for (struct block_header_t* block = arena->bins[bin]; block != NULL; block = REVEAL_LINK(block->next)) {
+                stats_count_free(stats, get_size(block));
+            }
+        }
+        for (struct tree_node_t* node = tree_next(arena, NULL); node != NULL; node = tree_next(arena, node)) {
+            stats_count_free(stats, get_size((struct block_header_t*)node));
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    pthread_mutex_lock(&slab_lock);
+    stats->slab_bytes = slab_next - slab_region;
+    pthread_mutex_unlock(&slab_lock);
+    stats->mmap_blocks = __atomic_load_n(&mmap_blocks, __ATOMIC_RELAXED);
+    stats->mmap_bytes = __atomic_load_n(&mmap_bytes, __ATOMIC_RELAXED);
+    stats->fragmentation = stats->free_bytes == 0 ? 0 : 1 - (double)stats->largest_free_block / stats->free_bytes;
+}
+
+int MallocStatsPrint(int fd, int format) {
+    struct malloc_stats stats;
+    MallocStats(&stats);
+    // Formatted on the stack so printing never allocates
+    char buffer[4096];
+    int json = format == MALLOC_STATS_JSON;
+    int length = snprintf(buffer, sizeof(buffer), json
+        ? "{\"malloc_calls\":%lu,\"free_calls\":%lu,\"in_use_bytes\":%lu,\"heap_bytes\":%lu,"
+          "\"free_bytes\":%lu,\"free_blocks\":%lu,\"largest_free_block\":%lu,\"slab_bytes\":%lu,"
+          "\"mmap_bytes\":%lu,\"mmap_blocks\":%lu,\"sbrk_calls\":%lu,\"numa_nodes\":%lu,\"cross_node_frees\":%lu,"
+          "\"fragmentation\":%.4f,\"free_histogram\":{"
+        : "malloc calls        %lu\nfree calls          %lu\nin use bytes        %lu\nheap bytes          %lu\n"
+          "free bytes          %lu\nfree blocks         %lu\nlargest free block  %lu\nslab bytes          %lu\n"
+          "mmap bytes          %lu\nmmap blocks         %lu\nsbrk calls          %lu\nnuma nodes          %lu\n"
+          "cross node frees    %lu\nfragmentation       %.4f\n"
+          "free blocks by size\n",
+        stats.malloc_calls, stats.free_calls, stats.in_use_bytes, stats.heap_bytes,
+        stats.free_bytes, stats.free_blocks, stats.largest_free_block, stats.slab_bytes,
+        stats.mmap_bytes, stats.mmap_blocks, stats.sbrk_calls, stats.numa_nodes,
+        stats.cross_node_frees, stats.fragmentation);
+    char separator = ' ';
+    for (unsigned int bucket = 0; bucket < MALLOC_STATS_BUCKETS; bucket++) {
+        if (stats.free_histogram[bucket] == 0) {
+            continue;
+        }
+        if (json) {
+            length += snprintf(buffer + length, sizeof(buffer) - length, "%c\"%lu\":%lu",
+                               separator, 1UL << bucket, stats.free_histogram[bucket]);
+            separator = ',';
+        } else {
+            length += snprintf(buffer + length, sizeof(buffer) - length, "  >= %-14lu %lu\n",
+                               1UL << bucket, stats.free_histogram[bucket]);
+        }
+    }
+    if (json) {
+        length += snprintf(buffer + length, sizeof(buffer) - length, "}}\n");
+    }
+    for (char* out = buffer; length > 0; ) {
+        ssize_t written = write(fd, out, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        out += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/* Report the blocks from block up to and including last, or up to the sentinel
+ * closing the segment if last is NULL. Called with the arena lock held */
+static int walk_blocks(struct block_header_t* block, struct block_header_t* last, unsigned int index,
+                       malloc_walk_fn callback, void* ctx) {
+    for (;;) {
+        uint64_t size = get_size(block);
+        if (last == NULL && size == 0) {
+            return 0;
+        }
+        struct malloc_walk_block walk = {
+            .ptr = data_addr(block),
+            .size = is_free(block) ? size : size - CANARY_SIZE,
+            .span = size + BLOCK_OVERHEAD,
+            .arena = index,
+            .free = is_free(block),
+        };
+        int stop = callback(&walk, ctx);
+        if (stop != 0 || block == last) {
+            return stop;
+        }
+        block = next_adjacent(block);
+    }
+}
+
+int HeapWalk(malloc_walk_fn callback, void* ctx) {
+    int stop = 0;
+    for (unsigned int i = 0; i < MAX_ARENAS && stop == 0; i++) {
+        struct arena_t* arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+        if (arena == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&arena->lock);
+        // Blocks waiting to be merged would show up as used
+        remote_drain(arena);
+#ifdef MALLOC_DEFERRED_COALESCE
+        fastbin_consolidate(arena);
+#endif
+        if (arena->heap != (char*)-1 && arena->last != NULL) {
+            stop = walk_blocks((struct block_header_t*)arena->heap, arena->last, i, callback, ctx);
+        }
+        for (struct heap_info_t* info = arena->segment; stop == 0 && info != NULL && info->prev_heap != NULL;
+             info = info->prev) {
+            stop = walk_blocks((struct block_header_t*)info->prev_heap, NULL, i, callback, ctx);
         }
+        pthread_mutex_unlock(&arena->lock);
     }
+    return stop;
 }
@@ -3,4 +3,181 @@
 
 void* Malloc(unsigned long size);
 void Free(void* ptr);
+
+/* Allocate zeroed space for count objects of size bytes. Returns NULL if the
+ * product overflows or memory is exhausted */
+void* Calloc(unsigned long count, unsigned long size);
+
+/* Allocate size bytes aligned to alignment, which must be a power of two.
+ * Returns NULL if alignment is invalid or memory is exhausted. Malloc data is
+ * always aligned to 16 bytes */
+void* Memalign(unsigned long alignment, unsigned long size);
+
+/* POSIX flavored Memalign. Stores the block in memptr and returns 0, EINVAL if
+ * alignment is not a power of two multiple of sizeof(void*), or ENOMEM */
+int PosixMemalign(void** memptr, unsigned long alignment, unsigned long size);
+
+/* C11 flavored Memalign */
+void* AlignedAlloc(unsigned long alignment, unsigned long size);
+
+/* Allocate size bytes from memory of NUMA node node. Returns NULL if node is not
+ * online or memory is exhausted. On a single node machine it is Malloc */
+void* MallocOnNode(unsigned long size, int node);
+
+/* Free ptr, which was allocated with size bytes. Passing the size lets small
+ * blocks skip reading their header. Builds with MALLOC_DEBUG abort on a
+ * size that does not match the allocation */
+void FreeSized(void* ptr, unsigned long size);
+
+/* Allocate up to n blocks of size bytes into out under a single lock hold,
+ * carving runs of heap blocks from one free block. Returns the number of
+ * blocks stored, fewer than n only when memory is exhausted */
+unsigned long MallocBatch(unsigned long size, unsigned long n, void** out);
+
+/* Free the n blocks in ptrs, skipping NULL entries. Blocks of the same arena
+ * are freed under one lock hold */
+void FreeBatch(void** ptrs, unsigned long n);
+
+/* Resize the block at ptr to size bytes, in place when possible. Returns the
+ * new address, or NULL on failure, in which case ptr is left untouched.
+ * A size of 0 frees ptr and returns NULL */
+void* Realloc(void* ptr, unsigned long size);
+
+/* Return the number of bytes usable at ptr, at least the size it was allocated
+ * with. Any of them may be written, and the usable size may be passed to
+ * FreeSized. Returns 0 for NULL */
+unsigned long MallocUsableSize(void* ptr);
+
+/* Return the usable size Malloc grants a request of size bytes, so growable
+ * buffers can take the whole block up front. A heap block may come with more
+ * when the slack of a free block is too small to split off. Returns 0 if no
+ * block can be that large */
+unsigned long MallocGoodSize(unsigned long size);
+
+/* A region hands out memory with a bump pointer and frees all of it at once.
+ * A region must not be used by two threads at the same time */
+struct region_t;
+
+/* Create an empty region. Returns NULL if memory is exhausted */
+struct region_t* RegionCreate(void);
+
+/* Allocate size bytes, aligned to 16, from region. The memory is valid until
+ * the region is reset or destroyed and must not be passed to Free */
+void* RegionAlloc(struct region_t* region, unsigned long size);
+
+/* Free everything allocated from region, keeping it ready for reuse */
+void RegionReset(struct region_t* region);
+
+/* Free everything allocated from region, and the region itself */
+void RegionDestroy(struct region_t* region);
+
+/* Parameters for Mallopt */
+#define MALLOC_OPT_MMAP_THRESHOLD   1   /* requests of at least this many bytes get their own mapping */
+#define MALLOC_OPT_TRIM_THRESHOLD   2   /* free blocks of at least this many bytes are returned to the system */
+#define MALLOC_OPT_PROFILE_INTERVAL 3   /* mean bytes between profiled allocations, 0 stops sampling. MALLOC_PROFILE builds only */
+#define MALLOC_OPT_TCACHE_MAX       4   /* freed small blocks each thread keeps per size class */
+#define MALLOC_OPT_TCACHE_FILL      5   /* small blocks moved into a thread's cache per refill, at least 1 */
+#define MALLOC_OPT_HUGEPAGES        6   /* one of MALLOC_HUGEPAGES_*, taken by arenas as their heaps grow large */
+#define MALLOC_OPT_DECAY_TIME       7   /* ms large free blocks and empty slab runs age before a background
+                                           thread releases their pages, instead of Free releasing them at once.
+                                           0 restores that */
+
+/* Values of MALLOC_OPT_HUGEPAGES. Set it before the first allocation for the main heap to follow */
+#define MALLOC_HUGEPAGES_OFF        0   /* 4 KiB pages only */
+#define MALLOC_HUGEPAGES_THP        1   /* advise large heaps for transparent huge pages */
+#define MALLOC_HUGEPAGES_HUGETLB    2   /* map large heaps from the hugetlbfs pool, THP once it runs dry */
+
+/* Return free memory of every arena and idle region chunks to the system. Returns 1 if any was released, 0 otherwise */
+int Trim(void);
+
+/* Set an allocator parameter. Returns 0 on success, -1 if param is unknown or
+ * value is out of range. The same parameters can be set before the first call
+ * through MALLOC_CONF, e.g. MALLOC_CONF=mmap_threshold:1m,tcache_max:64, which
+ * also takes arenas:N to cap the number of arenas */
+int Mallopt(int param, unsigned long value);
+
+/* Number of power of two buckets in malloc_stats.free_histogram */
+#define MALLOC_STATS_BUCKETS        40
+
+/* Heap statistics filled in by MallocStats */
+struct malloc_stats {
+    unsigned long malloc_calls;         /* allocations, counting each block of a batch */
+    unsigned long free_calls;
+    unsigned long in_use_bytes;         /* usable bytes of live blocks */
+    unsigned long heap_bytes;           /* bytes of arena heaps obtained from the system */
+    unsigned long free_bytes;           /* bytes in free heap blocks */
+    unsigned long free_blocks;
+    unsigned long largest_free_block;
+    unsigned long slab_bytes;           /* bytes of slab runs carved so far */
+    unsigned long mmap_bytes;           /* bytes mapped for blocks above the mmap threshold */
+    unsigned long mmap_blocks;
+    unsigned long sbrk_calls;           /* heap growth syscalls */
+    unsigned long numa_nodes;
+    unsigned long cross_node_frees;     /* blocks freed into an arena of another NUMA node */
+    double fragmentation;               /* 1 - largest_free_block / free_bytes */
+    unsigned long free_histogram[MALLOC_STATS_BUCKETS]; /* free blocks of size 2^i up to 2^(i+1) - 1 in bucket i */
+};
+
+/* Fill stats with counters summed over every thread and arena */
+void MallocStats(struct malloc_stats* stats);
+
+/* Formats for MallocStatsPrint */
+#define MALLOC_STATS_TEXT           0
+#define MALLOC_STATS_JSON           1
+
+/* Write MallocStats to fd as text or as one line of JSON. Returns 0, or -1 on a write error */
+int MallocStatsPrint(int fd, int format);
+
+/* A heap block as reported by HeapWalk */
+struct malloc_walk_block {
+    void* ptr;                          /* data of the block, as Malloc returned it if in use */
+    unsigned long size;                 /* usable bytes at ptr */
+    unsigned long span;                 /* bytes from the 8 byte header before ptr to the next block */
+    unsigned int arena;                 /* index of the owning arena, 0 for the main one */
+    int free;                           /* 1 if the block is free, 0 if in use */
+};
+
+/* Called by HeapWalk on each block. Returning nonzero stops the walk */
+typedef int (*malloc_walk_fn)(const struct malloc_walk_block* block, void* ctx);
+
+/* Call callback on every heap block of every arena, in address order within
+ * each heap segment. Slab slots and blocks mapped on their own are left out.
+ * Each arena stays locked while its blocks are reported, so callback must not
+ * allocate or free. Returns 0, or the value that stopped the walk */
+int HeapWalk(malloc_walk_fn callback, void* ctx);
+
+/* Write the live sampled allocations of a MALLOC_PROFILE build to fd in the
+ * pprof heap_v2 format. Returns 0, or -1 on a write error */
+int MallocProfileDump(int fd);
+
+/* Dump the profile to fd when signo arrives. The dump is written by the next
+ * sampled allocation, since it can not be done in the handler. Returns 0, or -1 */
+int MallocProfileSignal(int signo, int fd);
+
+/* Operations logged by MALLOC_TRACE builds */
+#define MALLOC_TRACE_MALLOC         1   /* Malloc or MallocBatch returned id */
+#define MALLOC_TRACE_CALLOC         2   /* Calloc of size bytes in all returned id */
+#define MALLOC_TRACE_MEMALIGN       3   /* old holds the alignment */
+#define MALLOC_TRACE_REALLOC        4   /* old was resized to id, which is 0 if the call failed or freed old */
+#define MALLOC_TRACE_FREE           5
+
+/* One entry of a trace file. Records of a thread appear in call order, those of
+ * different threads interleave in chunks, so replay orders them by time */
+struct malloc_trace_record {
+    unsigned long time;                 /* CLOCK_MONOTONIC ns */
+    unsigned long id;                   /* address of the block */
+    unsigned long size;                 /* requested bytes */
+    unsigned long old;
+    unsigned int thread;                /* 1 for the first thread to allocate, and so on */
+    unsigned int op;
+};
+
+/* Log every call of a MALLOC_TRACE build to path, which is truncated. A %p in
+ * path is replaced by the process id. Tracing also starts on its own when
+ * MALLOC_TRACE_FILE names a file. Returns 0, or -1 if a trace is already open,
+ * path can not be created or another process is tracing to it */
+int MallocTraceStart(const char* path);
+
+/* Flush every thread's records and close the trace file */
+void MallocTraceStop(void);
 #endif
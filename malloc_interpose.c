@@ -0,0 +1,148 @@
+/* Exports the allocator under the standard libc names, for use as a drop-in
+ * replacement through LD_PRELOAD or by linking it ahead of libc. Build with
+ *
+ *   gcc -O2 -fPIC -ftls-model=initial-exec -c malloc_interpose.c
+ *   g++ -O2 -fPIC -c malloc_new.cc
+ *   g++ -shared -o libmalloc.so malloc_interpose.o malloc_new.o -lpthread
+ *
+ * and run with LD_PRELOAD=./libmalloc.so. The allocator is compiled into this
+ * translation unit so the wrappers inline, and so the fork handlers can reach
+ * its internals. */
+#include "malloc.c"
+
+#define EXPORT                      __attribute__((visibility("default")))
+
+EXPORT void* malloc(size_t size) {
+    void* ptr = Malloc(size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+EXPORT void free(void* ptr) {
+    Free(ptr);
+}
+
+EXPORT void* calloc(size_t count, size_t size) {
+    void* ptr = Calloc(count, size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+EXPORT void* realloc(void* ptr, size_t size) {
+    void* new_ptr = Realloc(ptr, size);
+    if (new_ptr == NULL && size != 0) {
+        errno = ENOMEM;
+    }
+    return new_ptr;
+}
+
+EXPORT void* reallocarray(void* ptr, size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, count * size);
+}
+
+EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    return PosixMemalign(memptr, alignment, size);
+}
+
+EXPORT void* memalign(size_t alignment, size_t size) {
+    void* ptr = Memalign(alignment, size);
+    if (ptr == NULL) {
+        errno = (alignment & (alignment - 1)) != 0 ? EINVAL : ENOMEM;
+    }
+    return ptr;
+}
+
+EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+EXPORT void* valloc(size_t size) {
+    return memalign(PAGE_SIZE, size);
+}
+
+EXPORT void* pvalloc(size_t size) {
+    return memalign(PAGE_SIZE, (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
+
+EXPORT size_t malloc_usable_size(void* ptr) {
+    return MallocUsableSize(ptr);
+}
+
+/* Take every allocator lock so the child of a fork starts from a consistent heap.
+ * The order matches the one used while allocating: arenas_lock, arena locks,
+ * slab_lock, then the stats and profile locks, which are taken under none of the others */
+static void fork_prepare() {
+    pthread_mutex_lock(&arenas_lock);
+    for (unsigned int i = 0; i < MAX_ARENAS; i++) {
+        if (arenas[i] != NULL) {
+            pthread_mutex_lock(&arenas[i]->lock);
+        }
+    }
+    pthread_mutex_lock(&slab_lock);
+    pthread_mutex_lock(&region_lock);
+    pthread_mutex_lock(&stats_lock);
+#ifdef MALLOC_PROFILE
+    pthread_mutex_lock(&profile_lock);
+#endif
+}
+
+static void fork_parent() {
+#ifdef MALLOC_PROFILE
+    pthread_mutex_unlock(&profile_lock);
+#endif
+    pthread_mutex_unlock(&stats_lock);
+    pthread_mutex_unlock(&region_lock);
+    pthread_mutex_unlock(&slab_lock);
+    for (unsigned int i = MAX_ARENAS; i-- > 0; ) {
+        if (arenas[i] != NULL) {
+            pthread_mutex_unlock(&arenas[i]->lock);
+        }
+    }
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+/* The child has only the forking thread, so the locks are reset rather than
+ * unlocked, and the counters of the other threads are folded in as if they had exited */
+static void fork_child() {
+#ifdef MALLOC_PROFILE
+    pthread_mutex_init(&profile_lock, NULL);
+#endif
+    for (struct thread_stats_t* thread = stats_threads; thread != NULL; thread = thread->next) {
+        if (thread != &thread_stats) {
+            exited_stats.malloc_calls += thread->malloc_calls;
+            exited_stats.free_calls += thread->free_calls;
+            exited_stats.allocated_bytes += thread->allocated_bytes;
+            exited_stats.freed_bytes += thread->freed_bytes;
+            exited_stats.cross_node_frees += thread->cross_node_frees;
+        }
+    }
+    stats_threads = thread_stats.linked ? &thread_stats : NULL;
+    thread_stats.prev = NULL;
+    thread_stats.next = NULL;
+    pthread_mutex_init(&stats_lock, NULL);
+    pthread_mutex_init(&region_lock, NULL);
+    pthread_mutex_init(&slab_lock, NULL);
+    for (unsigned int i = 0; i < MAX_ARENAS; i++) {
+        if (arenas[i] != NULL) {
+            pthread_mutex_init(&arenas[i]->lock, NULL);
+            // Only the forking thread survives to poll remote frees
+            arenas[i]->threads = 0;
+        }
+    }
+    if (thread_arena != NULL) {
+        thread_arena->threads = 1;
+    }
+    pthread_mutex_init(&arenas_lock, NULL);
+}
+
+static void __attribute__((constructor)) interpose_init() {
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
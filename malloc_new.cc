@@ -0,0 +1,112 @@
+// C++ allocation operators for the interposed build, see malloc_interpose.c
+#include <new>
+#include <cstddef>
+
+extern "C" {
+#include "malloc.h"
+}
+
+// Retry through the installed new_handler until memory is found, as the standard requires
+static void* new_impl(std::size_t size, std::size_t alignment) {
+    for (;;) {
+        void* ptr = alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? Malloc(size) : Memalign(alignment, size);
+        if (ptr != nullptr) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+static void* new_nothrow_impl(std::size_t size, std::size_t alignment) noexcept {
+    try {
+        return new_impl(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new(std::size_t size) {
+    return new_impl(size, 0);
+}
+
+void* operator new[](std::size_t size) {
+    return new_impl(size, 0);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return new_nothrow_impl(size, 0);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return new_nothrow_impl(size, 0);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return new_impl(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return new_impl(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return new_nothrow_impl(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return new_nothrow_impl(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept {
+    Free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    Free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    Free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    Free(ptr);
+}
+
+// Sized deletes skip the header read for small blocks
+void operator delete(void* ptr, std::size_t size) noexcept {
+    FreeSized(ptr, size);
+}
+
+void operator delete[](void* ptr, std::size_t size) noexcept {
+    FreeSized(ptr, size);
+}
+
+// Over-aligned blocks never come from slab runs, so their size is of no use
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    Free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    Free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    Free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+    Free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    Free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    Free(ptr);
+}
@@ -0,0 +1,453 @@
+/* Replays a trace written by a MALLOC_TRACE build through Malloc and Free, in
+ * the time order of the recorded calls, and reports how long the calls took
+ * and how much memory the heap needed. Build and run with
+ *
+ *   gcc -O2 -o replay replay.c malloc_interpose.c -lpthread
+ *   ./replay [-t] [-f] trace
+ *
+ * -t writes a byte per page of every block, so RSS reflects the footprint the
+ * traced program had rather than only the pages the allocator touched. -f walks
+ * the heap once the replay is done and prints a fragmentation report: the sizes
+ * of free blocks, the largest free span, and a map of each segment. All
+ * bookkeeping is mapped directly and faulted in before the replay starts, so
+ * the reported RSS is what the heap added on top of it. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "malloc.h"
+
+#define RSS_SAMPLE_OPS              4096      /* RSS is read this often */
+#define MAP_COLUMNS                 64        /* cells per line of the segment map */
+#define MAP_CELLS                   (16 * MAP_COLUMNS)
+
+/* Maps a traced block address to the block handed out in the replay */
+struct live_entry_t {
+    uint64_t                        id;         /* 0 marks an empty slot */
+    void*                           ptr;
+    uint64_t                        size;
+};
+
+static struct live_entry_t*         live = NULL;
+static uint64_t                     live_mask = 0; /* capacity - 1, a power of two */
+static uint64_t                     live_bytes = 0;
+static uint64_t                     peak_live_bytes = 0;
+
+static void* map_zeroed(uint64_t size) {
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return ptr;
+}
+
+static inline uint64_t slot_of(uint64_t id) {
+    return (id >> 4) * 0x9e3779b97f4a7c15UL & live_mask;
+}
+
+static struct live_entry_t* live_find(uint64_t id) {
+    for (uint64_t slot = slot_of(id); live[slot].id != 0; slot = (slot + 1) & live_mask) {
+        if (live[slot].id == id) {
+            return &live[slot];
+        }
+    }
+    return NULL;
+}
+
+static void live_insert(uint64_t id, void* ptr, uint64_t size) {
+    uint64_t slot = slot_of(id);
+    while (live[slot].id != 0 && live[slot].id != id) {
+        slot = (slot + 1) & live_mask;
+    }
+    live[slot].id = id;
+    live[slot].ptr = ptr;
+    live[slot].size = size;
+    live_bytes += size;
+    if (live_bytes > peak_live_bytes) {
+        peak_live_bytes = live_bytes;
+    }
+}
+
+/* Remove entry, shifting later entries of its probe run back so lookups need no tombstones */
+static void live_remove(struct live_entry_t* entry) {
+    live_bytes -= entry->size;
+    uint64_t hole = entry - live;
+    for (uint64_t slot = (hole + 1) & live_mask; live[slot].id != 0; slot = (slot + 1) & live_mask) {
+        uint64_t home = slot_of(live[slot].id);
+        // Move the entry back if the hole lies between its home slot and where it sits
+        if (((slot - home) & live_mask) >= ((slot - hole) & live_mask)) {
+            live[hole] = live[slot];
+            hole = slot;
+        }
+    }
+    live[hole].id = 0;
+}
+
+static void touch(char* ptr, uint64_t size) {
+    for (uint64_t i = 0; i < size; i += 4096) {
+        ptr[i] = 1;
+    }
+}
+
+/* Resident anonymous memory, which leaves out the mapped trace */
+static uint64_t rss_bytes() {
+    char buffer[64];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t got = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (got <= 0) {
+        return 0;
+    }
+    buffer[got] = 0;
+    char* field;
+    strtoull(buffer, &field, 10);
+    uint64_t resident = strtoull(field, &field, 10);
+    uint64_t shared = strtoull(field, NULL, 10);
+    return (resident - shared) * sysconf(_SC_PAGESIZE);
+}
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Order the records by time. Each thread's records are already in call order,
+ * so they are grouped per thread and the groups merged through a heap */
+static uint64_t* order_records(const struct malloc_trace_record* records, uint64_t count) {
+    uint32_t threads = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (records[i].thread > threads) {
+            threads = records[i].thread;
+        }
+    }
+    threads++;
+    uint64_t* starts = map_zeroed((threads + 1) * sizeof(uint64_t));
+    for (uint64_t i = 0; i < count; i++) {
+        starts[records[i].thread + 1]++;
+    }
+    for (uint32_t thread = 0; thread < threads; thread++) {
+        starts[thread + 1] += starts[thread];
+    }
+    uint64_t* grouped = map_zeroed(count * sizeof(uint64_t));
+    uint64_t* cursors = map_zeroed(threads * sizeof(uint64_t));
+    memcpy(cursors, starts, threads * sizeof(uint64_t));
+    for (uint64_t i = 0; i < count; i++) {
+        grouped[cursors[records[i].thread]++] = i;
+    }
+    // Heap of threads keyed by the time of their next record
+    uint32_t* heap = map_zeroed(threads * sizeof(uint32_t));
+    uint32_t heap_size = 0;
+    memcpy(cursors, starts, threads * sizeof(uint64_t));
+#define NEXT_TIME(thread)           records[grouped[cursors[thread]]].time
+    for (uint32_t thread = 0; thread < threads; thread++) {
+        if (cursors[thread] == starts[thread + 1]) {
+            continue;
+        }
+        uint32_t child = heap_size++;
+        while (child > 0 && NEXT_TIME(heap[(child - 1) / 2]) > NEXT_TIME(thread)) {
+            heap[child] = heap[(child - 1) / 2];
+            child = (child - 1) / 2;
+        }
+        heap[child] = thread;
+    }
+    uint64_t* order = map_zeroed(count * sizeof(uint64_t));
+    for (uint64_t i = 0; heap_size > 0; i++) {
+        uint32_t thread = heap[0];
+        order[i] = grouped[cursors[thread]++];
+        if (cursors[thread] == starts[thread + 1]) {
+            thread = heap[--heap_size];
+            if (heap_size == 0) {
+                break;
+            }
+        }
+        // Sift thread down from the root
+        uint32_t parent = 0;
+        for (;;) {
+            uint32_t child = 2 * parent + 1;
+            if (child >= heap_size) {
+                break;
+            }
+            if (child + 1 < heap_size && NEXT_TIME(heap[child + 1]) < NEXT_TIME(heap[child])) {
+                child++;
+            }
+            if (NEXT_TIME(heap[child]) >= NEXT_TIME(thread)) {
+                break;
+            }
+            heap[parent] = heap[child];
+            parent = child;
+        }
+        heap[parent] = thread;
+    }
+#undef NEXT_TIME
+    munmap(heap, threads * sizeof(uint32_t));
+    munmap(cursors, threads * sizeof(uint64_t));
+    munmap(grouped, count * sizeof(uint64_t));
+    munmap(starts, (threads + 1) * sizeof(uint64_t));
+    return order;
+}
+
+/* State of the fragmentation report. HeapWalk holds arena locks, so the
+ * callbacks do not allocate and the maps are only printed after the walk */
+struct frag_report_t {
+    uint64_t                        used_bytes;
+    uint64_t                        free_bytes;
+    uint64_t                        free_blocks;
+    uint64_t                        largest_block;
+    uint64_t                        largest_span; /* free bytes of a run of adjacent free blocks */
+    uint64_t                        span;
+    char*                           span_end;
+    uint64_t                        histogram[MALLOC_STATS_BUCKETS];
+    char*                           segment;    /* start of the segment being mapped */
+    char*                           segment_end;
+    uint64_t                        cell_size;
+    uint32_t                        cell_used[MAP_CELLS]; /* bit 0 used bytes seen, bit 1 free bytes seen */
+    char                            map[1 << 18]; /* printed once the walk is over */
+    uint64_t                        map_length;
+};
+
+static struct frag_report_t         report;
+
+static int frag_count(const struct malloc_walk_block* block, void* ctx) {
+    (void)ctx;
+    char* start = (char*)block->ptr - sizeof(uint64_t);
+    if (!block->free) {
+        report.used_bytes += block->span;
+        report.span = 0;
+        return 0;
+    }
+    report.free_bytes += block->size;
+    report.free_blocks++;
+    if (block->size > report.largest_block) {
+        report.largest_block = block->size;
+    }
+    unsigned int bucket = 63 - __builtin_clzll(block->size | 1);
+    report.histogram[bucket < MALLOC_STATS_BUCKETS ? bucket : MALLOC_STATS_BUCKETS - 1]++;
+    // Free blocks are merged on free, but a segment boundary or a pending merge can split a run
+    report.span = start == report.span_end ? report.span + block->size : block->size;
+    report.span_end = start + block->span;
+    if (report.span > report.largest_span) {
+        report.largest_span = report.span;
+    }
+    return 0;
+}
+
+/* Append the map of the segment just walked to the report buffer */
+static void frag_map_print() {
+    uint64_t cells = (report.segment_end - report.segment + report.cell_size - 1) / report.cell_size;
+    uint64_t room = sizeof(report.map) - report.map_length;
+    if (room < 128 + cells + cells / MAP_COLUMNS * 4) {
+        return;
+    }
+    char* out = report.map + report.map_length;
+    out += snprintf(out, 128, "  %p  %lu KiB, %lu KiB per cell\n", (void*)report.segment,
+                    (unsigned long)(report.segment_end - report.segment) >> 10, (unsigned long)report.cell_size >> 10);
+    for (uint64_t cell = 0; cell < cells; cell++) {
+        if (cell % MAP_COLUMNS == 0) {
+            memcpy(out, "   ", 3);
+            out += 3;
+        }
+        *out++ = " #.+"[report.cell_used[cell] & 3];
+        if (cell % MAP_COLUMNS == MAP_COLUMNS - 1 || cell == cells - 1) {
+            *out++ = '\n';
+        }
+    }
+    report.map_length = out - report.map;
+}
+
+static int frag_map(const struct malloc_walk_block* block, void* ctx) {
+    (void)ctx;
+    char* start = (char*)block->ptr - sizeof(uint64_t);
+    if (start != report.segment_end) {
+        // Not adjacent to the previous block, so a new segment starts here
+        if (report.segment != NULL) {
+            frag_map_print();
+        }
+        report.segment = start;
+        report.segment_end = start;
+        report.cell_size = 4096;
+        memset(report.cell_used, 0, sizeof(report.cell_used));
+    }
+    char* end = start + block->span;
+    // Double the cell size until the segment fits, folding pairs of cells together
+    while ((uint64_t)(end - report.segment) > report.cell_size * MAP_CELLS) {
+        for (unsigned int cell = 0; cell < MAP_CELLS / 2; cell++) {
+            report.cell_used[cell] = report.cell_used[2 * cell] | report.cell_used[2 * cell + 1];
+        }
+        memset(report.cell_used + MAP_CELLS / 2, 0, sizeof(report.cell_used) / 2);
+        report.cell_size *= 2;
+    }
+    uint64_t first = (start - report.segment) / report.cell_size;
+    uint64_t last = (end - 1 - report.segment) / report.cell_size;
+    for (uint64_t cell = first; cell <= last; cell++) {
+        report.cell_used[cell] |= block->free ? 2 : 1;
+    }
+    report.segment_end = end;
+    return 0;
+}
+
+static void frag_report() {
+    memset(&report, 0, sizeof(report));
+    HeapWalk(frag_count, NULL);
+    uint64_t free_bytes = report.free_bytes;
+    printf("fragmentation report\n");
+    printf("  used bytes        %lu\n", report.used_bytes);
+    printf("  free bytes        %lu\n", free_bytes);
+    printf("  free blocks       %lu\n", report.free_blocks);
+    printf("  largest block     %lu\n", report.largest_block);
+    printf("  largest span      %lu\n", report.largest_span);
+    printf("  external frag     %.1f%%\n", free_bytes == 0 ? 0 : 100 * (1 - (double)report.largest_span / free_bytes));
+    printf("  free block sizes\n");
+    for (unsigned int bucket = 0; bucket < MALLOC_STATS_BUCKETS; bucket++) {
+        if (report.histogram[bucket] != 0) {
+            printf("    >= %-12lu %lu\n", 1UL << bucket, report.histogram[bucket]);
+        }
+    }
+    printf("  segments, # used . free + both\n");
+    report.segment = NULL;
+    report.segment_end = NULL;
+    HeapWalk(frag_map, NULL);
+    if (report.segment != NULL) {
+        frag_map_print();
+    }
+    fwrite(report.map, 1, report.map_length, stdout);
+}
+
+int main(int argc, char** argv) {
+    int touch_pages = 0;
+    int fragmentation = 0;
+    for (int option; (option = getopt(argc, argv, "tf")) != -1; ) {
+        if (option == 't') {
+            touch_pages = 1;
+        } else if (option == 'f') {
+            fragmentation = 1;
+        } else {
+            fprintf(stderr, "usage: %s [-t] [-f] trace\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-t] [-f] trace\n", argv[0]);
+        return 2;
+    }
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    uint64_t count = st.st_size / sizeof(struct malloc_trace_record);
+    if (count == 0) {
+        fprintf(stderr, "%s: empty trace\n", argv[optind]);
+        return 1;
+    }
+    const struct malloc_trace_record* records = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (records == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    uint64_t* order = order_records(records, count);
+    uint64_t capacity = 16;
+    while (capacity < 2 * count) {
+        capacity <<= 1;
+    }
+    live = map_zeroed(capacity * sizeof(struct live_entry_t));
+    live_mask = capacity - 1;
+    memset(live, 0, capacity * sizeof(struct live_entry_t));
+
+    uint64_t unmatched = 0;
+    uint64_t failed = 0;
+    uint64_t base_rss = rss_bytes();
+    uint64_t peak_rss = base_rss;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < count; i++) {
+        const struct malloc_trace_record* record = &records[order[i]];
+        void* ptr = NULL;
+        switch (record->op) {
+        case MALLOC_TRACE_MALLOC:
+        case MALLOC_TRACE_CALLOC:
+        case MALLOC_TRACE_MEMALIGN:
+            ptr = record->op == MALLOC_TRACE_MALLOC ? Malloc(record->size)
+                : record->op == MALLOC_TRACE_CALLOC ? Calloc(1, record->size)
+                : Memalign(record->old, record->size);
+            if (ptr == NULL) {
+                failed++;
+                break;
+            }
+            live_insert(record->id, ptr, record->size);
+            break;
+        case MALLOC_TRACE_REALLOC: {
+            if (record->id == 0 && record->size != 0) {
+                // The traced call failed and left the block alone
+                break;
+            }
+            struct live_entry_t* entry = record->old == 0 ? NULL : live_find(record->old);
+            if (record->old != 0 && entry == NULL) {
+                unmatched++;
+                break;
+            }
+            ptr = Realloc(entry == NULL ? NULL : entry->ptr, record->size);
+            if (entry != NULL) {
+                live_remove(entry);
+            }
+            if (record->size != 0) {
+                if (ptr == NULL) {
+                    failed++;
+                    break;
+                }
+                live_insert(record->id, ptr, record->size);
+            }
+            break;
+        }
+        case MALLOC_TRACE_FREE: {
+            struct live_entry_t* entry = live_find(record->id);
+            if (entry == NULL) {
+                // Allocated before tracing started
+                unmatched++;
+                break;
+            }
+            Free(entry->ptr);
+            live_remove(entry);
+            break;
+        }
+        default:
+            unmatched++;
+            break;
+        }
+        if (touch_pages && ptr != NULL) {
+            touch(ptr, record->size);
+        }
+        if (i % RSS_SAMPLE_OPS == 0) {
+            uint64_t rss = rss_bytes();
+            if (rss > peak_rss) {
+                peak_rss = rss;
+            }
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    peak_rss -= base_rss;
+    printf("records             %lu\n", count);
+    printf("unmatched           %lu\n", unmatched);
+    printf("failed              %lu\n", failed);
+    printf("seconds             %.3f\n", seconds);
+    printf("ns per call         %.1f\n", seconds * 1e9 / count);
+    printf("peak live bytes     %lu\n", peak_live_bytes);
+    printf("peak RSS            %lu\n", peak_rss);
+    printf("RSS / live          %.2f\n", peak_live_bytes == 0 ? 0 : (double)peak_rss / peak_live_bytes);
+    fflush(stdout);
+    MallocStatsPrint(STDOUT_FILENO, MALLOC_STATS_TEXT);
+    if (fragmentation) {
+        frag_report();
+    }
+    return 0;
+}
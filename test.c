@@ -0,0 +1,700 @@
+/* Correctness tests for the allocator. The interposed build is compiled in, so
+ * libc and the threads it starts use the allocator too, and the tests can look
+ * at its internals. Build and run each flavor with
+ *
+ *   gcc -O2 -o test test.c -lpthread && ./test
+ *   gcc -O2 -DMALLOC_HARDENED -o test test.c -lpthread && ./test
+ *   gcc -O2 -DMALLOC_DEFERRED_COALESCE -o test test.c -lpthread && ./test
+ *   gcc -O2 -DMALLOC_PROFILE -o test test.c -lpthread && ./test
+ *   gcc -O2 -DMALLOC_TRACE -o test test.c -lpthread && ./test
+ *
+ * The MALLOC_TRACE flavor replays the trace it writes with ./replay, so build
+ * that first, as replay.c describes.
+ *
+ * Each test aborts through assert on the first failure. Tests that need a
+ * pristine heap, or that are expected to die, run in a forked child. */
+#include "malloc_interpose.c"
+#undef NDEBUG
+#include <assert.h>
+#include <sys/wait.h>
+
+#define FORK_CHILDREN               50        /* forks made while other threads allocate */
+
+static void fill(void* ptr, uint64_t size, int seed) {
+    for (uint64_t i = 0; i < size; i++) {
+        ((unsigned char*)ptr)[i] = (unsigned char)(seed + i);
+    }
+}
+
+static int filled(const void* ptr, uint64_t size, int seed) {
+    for (uint64_t i = 0; i < size; i++) {
+        if (((const unsigned char*)ptr)[i] != (unsigned char)(seed + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Run test in a child and return its wait status. stderr is silenced when quiet */
+static int run_child(void (*test)(void), int quiet) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (quiet) {
+            int fd = open("/dev/null", O_WRONLY);
+            dup2(fd, STDERR_FILENO);
+        }
+        alarm(30);
+        test();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return status;
+}
+
+static void expect_pass(void (*test)(void)) {
+    int status = run_child(test, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/* Resident bytes of the process */
+static uint64_t rss_bytes() {
+    char buffer[64];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    ssize_t got = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    assert(got > 0);
+    buffer[got] = '\0';
+    return strtoul(strchr(buffer, ' ') + 1, NULL, 10) * PAGE_SIZE;
+}
+
+/* Consecutive heap blocks of a fresh heap tile it, and a freed block is handed out again */
+static void test_blocks() {
+#ifdef MALLOC_PROFILE
+    // The first backtrace of a sample loads libgcc, which allocates between the blocks
+    void* frame;
+    backtrace(&frame, 1);
+#endif
+    char* prev = NULL;
+    // Smaller sizes are served from slab runs, which have no boundary tags
+    for (int i = (SLAB_MAX_SIZE >> 3) + 1; i < 200; i++) {
+        char* ptr = Malloc(i << 3);
+        if (prev != NULL) {
+            struct block_header_t* prev_block = (struct block_header_t*)head_addr(prev);
+            assert(next_adjacent(prev_block) == (struct block_header_t*)head_addr(ptr));
+        }
+        prev = ptr;
+    }
+    for (int i = 2; i < 200; i++) {
+        char* ptr1 = Malloc(i << 3);
+        Free(ptr1);
+        char* ptr2 = Malloc(i << 3);
+        Free(ptr2);
+        assert(ptr1 == ptr2);
+    }
+}
+
+static void test_malloc() {
+    static void* ptrs[512];
+    for (unsigned int i = 0; i < 512; i++) {
+        uint64_t size = i * i * 7 % 300000;
+        ptrs[i] = Malloc(size);
+        assert(ptrs[i] != NULL && ((uintptr_t)ptrs[i] & (MALLOC_ALIGNMENT - 1)) == 0);
+        fill(ptrs[i], size, i);
+    }
+    for (unsigned int i = 0; i < 512; i++) {
+        assert(filled(ptrs[i], i * i * 7 % 300000, i));
+        Free(ptrs[i]);
+    }
+    assert(Malloc(MAX_ALLOC_SIZE + 1) == NULL);
+    assert(Malloc(UINT64_MAX) == NULL);
+    Free(NULL);
+}
+
+static void test_calloc() {
+    uint64_t sizes[] = { 8, 200, 3000, 100000, 1 << 20 };
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        // Dirty a block first, so a reused one has to be cleared
+        char* dirty = Malloc(sizes[i]);
+        memset(dirty, 0xff, sizes[i]);
+        Free(dirty);
+        char* ptr = Calloc(1, sizes[i]);
+        assert(ptr != NULL);
+        for (uint64_t j = 0; j < sizes[i]; j++) {
+            assert(ptr[j] == 0);
+        }
+        Free(ptr);
+    }
+    assert(Calloc(UINT64_MAX / 2, 3) == NULL);
+    assert(Calloc(1UL << 32, 1UL << 32) == NULL);
+}
+
+static void test_memalign() {
+    for (uint64_t alignment = 16; alignment <= (1 << 20); alignment <<= 1) {
+        for (uint64_t size = 1; size < 400000; size = size * 5 + 3) {
+            char* ptr = Memalign(alignment, size);
+            assert(ptr != NULL && ((uintptr_t)ptr & (alignment - 1)) == 0);
+            assert(MallocUsableSize(ptr) >= size);
+            fill(ptr, size, 3);
+            Free(ptr);
+        }
+    }
+    assert(Memalign(24, 100) == NULL);
+    void* ptr = NULL;
+    assert(PosixMemalign(&ptr, 12, 100) == EINVAL);
+    assert(PosixMemalign(&ptr, 4, 100) == EINVAL);
+    assert(PosixMemalign(&ptr, 64, 100) == 0 && ((uintptr_t)ptr & 63) == 0);
+    Free(ptr);
+    ptr = AlignedAlloc(4096, 4096);
+    assert(ptr != NULL && ((uintptr_t)ptr & 4095) == 0);
+    Free(ptr);
+}
+
+static void test_realloc() {
+    // Grow through slab slots, heap blocks and mappings, then shrink back
+    uint64_t size = 1;
+    char* ptr = Realloc(NULL, size);
+    fill(ptr, size, 5);
+    while (size < (4 << 20)) {
+        uint64_t grown = size * 3 / 2 + 7;
+        ptr = Realloc(ptr, grown);
+        assert(ptr != NULL && filled(ptr, size, 5));
+        fill(ptr, grown, 5);
+        size = grown;
+    }
+    while (size > 16) {
+        size = size / 3;
+        ptr = Realloc(ptr, size);
+        assert(ptr != NULL && filled(ptr, size, 5));
+    }
+    // A failed resize leaves the block alone
+    assert(Realloc(ptr, MAX_ALLOC_SIZE + 1) == NULL);
+    assert(filled(ptr, size, 5));
+    assert(Realloc(ptr, 0) == NULL);
+}
+
+/* Growing a block into the free tail of a heap that can not grow falls back to a copy */
+static void realloc_stuck_heap() {
+    Mallopt(MALLOC_OPT_MMAP_THRESHOLD, 1UL << 30);
+    char* ptr = Malloc(1000);
+    fill(ptr, 1000, 9);
+    Free(Malloc(100000));
+    // Moving the break under the allocator stops the main heap from growing in place
+    sbrk(4096);
+    char* moved = Realloc(ptr, 500000);
+    assert(moved != NULL && filled(moved, 1000, 9));
+    Free(moved);
+}
+
+static void test_realloc_stuck_heap() {
+    expect_pass(realloc_stuck_heap);
+}
+
+static void test_free_sized() {
+    for (uint64_t size = 1; size < 300000; size = size * 3 + 1) {
+        void* ptr = Malloc(size);
+        FreeSized(ptr, size);
+        ptr = Malloc(size);
+        FreeSized(ptr, MallocUsableSize(ptr));
+    }
+}
+
+static void test_usable_size() {
+    assert(MallocUsableSize(NULL) == 0);
+    for (uint64_t size = 0; size < 2000000; size = size * 2 + 1) {
+        char* ptr = Malloc(size);
+        uint64_t usable = MallocUsableSize(ptr);
+        assert(usable >= size && usable >= MallocGoodSize(size));
+        memset(ptr, 1, usable);
+        Free(ptr);
+    }
+    assert(MallocGoodSize(MAX_ALLOC_SIZE + 1) == 0);
+}
+
+static void test_batch() {
+    uint64_t sizes[] = { 32, 200, 1000, 5000, 200000 };
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        void* ptrs[65];
+        // The first round fills the thread cache, so the second is served from it
+        for (int round = 0; round < 2; round++) {
+            struct malloc_stats before, after;
+            MallocStats(&before);
+            assert(MallocBatch(sizes[i], 64, ptrs) == 64);
+            for (unsigned int j = 0; j < 64; j++) {
+                assert(((uintptr_t)ptrs[j] & (MALLOC_ALIGNMENT - 1)) == 0);
+                assert(MallocUsableSize(ptrs[j]) >= sizes[i]);
+                fill(ptrs[j], sizes[i], j);
+            }
+            for (unsigned int j = 0; j < 64; j++) {
+                assert(filled(ptrs[j], sizes[i], j));
+            }
+            ptrs[64] = NULL;
+            FreeBatch(ptrs, 65);
+            MallocStats(&after);
+            assert(after.malloc_calls - before.malloc_calls == 64);
+            assert(after.free_calls - before.free_calls == 64);
+        }
+    }
+}
+
+static void test_region() {
+    struct region_t* region = RegionCreate();
+    assert(region != NULL);
+    for (int round = 0; round < 3; round++) {
+        for (uint64_t size = 1; size < (4 << 20); size = size * 3 + 1) {
+            char* ptr = RegionAlloc(region, size);
+            assert(ptr != NULL && ((uintptr_t)ptr & (MALLOC_ALIGNMENT - 1)) == 0);
+            memset(ptr, 2, size);
+        }
+        RegionReset(region);
+    }
+    assert(RegionAlloc(region, UINT64_MAX) == NULL);
+    assert(RegionAlloc(region, (uint64_t)-8) == NULL);
+    assert(RegionAlloc(region, MAX_ALLOC_SIZE + 1) == NULL);
+    RegionDestroy(region);
+}
+
+struct walk_totals_t {
+    uint64_t                        free_bytes;
+    void*                           target;
+    uint64_t                        target_size;
+    int                             found;
+    uint64_t                        blocks;
+};
+
+static int walk_count(const struct malloc_walk_block* block, void* ctx) {
+    struct walk_totals_t* totals = ctx;
+    assert(block->size + sizeof(uint64_t) <= block->span);
+    if (block->free) {
+        totals->free_bytes += block->size;
+    }
+    if (block->ptr == totals->target) {
+        assert(!block->free && block->size >= totals->target_size);
+        totals->found = 1;
+    }
+    totals->blocks++;
+    return totals->blocks == 5 && totals->target == NULL ? 7 : 0;
+}
+
+static void test_heap_walk() {
+    static void* ptrs[1000];
+    for (unsigned int i = 0; i < 1000; i++) {
+        ptrs[i] = Malloc(300 + i * 37 % 9000);
+    }
+    for (unsigned int i = 0; i < 1000; i += 3) {
+        Free(ptrs[i]);
+    }
+    struct walk_totals_t totals = { 0, ptrs[1], 300 + 37, 0, 0 };
+    assert(HeapWalk(walk_count, &totals) == 0);
+    struct malloc_stats stats;
+    MallocStats(&stats);
+    assert(totals.found && totals.free_bytes == stats.free_bytes);
+    // A nonzero return stops the walk
+    memset(&totals, 0, sizeof(totals));
+    assert(HeapWalk(walk_count, &totals) == 7 && totals.blocks == 5);
+    for (unsigned int i = 1; i < 1000; i++) {
+        if (i % 3 != 0) {
+            Free(ptrs[i]);
+        }
+    }
+}
+
+static void test_stats() {
+    struct malloc_stats before, after;
+    MallocStats(&before);
+    void* ptr = Malloc(100);
+    Free(ptr);
+    MallocStats(&after);
+    assert(after.malloc_calls - before.malloc_calls == 1);
+    assert(after.free_calls - before.free_calls == 1);
+    int fd = open("/dev/null", O_WRONLY);
+    assert(MallocStatsPrint(fd, MALLOC_STATS_TEXT) == 0);
+    assert(MallocStatsPrint(fd, MALLOC_STATS_JSON) == 0);
+    close(fd);
+}
+
+static void test_mallopt() {
+    assert(Mallopt(-1, 0) == -1);
+    assert(Mallopt(MALLOC_OPT_TCACHE_FILL, 0) == -1);
+    assert(Mallopt(MALLOC_OPT_HUGEPAGES, MALLOC_HUGEPAGES_HUGETLB + 1) == -1);
+    assert(Mallopt(MALLOC_OPT_DECAY_TIME, UINT64_MAX) == -1);
+    void* ptr = Malloc(1 << 20);
+    Free(ptr);
+    Trim();
+}
+
+#define TRIM_BLOCKS                 256       /* 64 KiB heap blocks grown and freed by test_trim */
+#define DECAY_TEST_TIME             100       /* ms of decay in test_decay */
+
+/* Free trims a tail well past the trim threshold down to a pad, and Trim
+ * gives the pad back */
+static void trim_heap() {
+    static void* blocks[TRIM_BLOCKS];
+    for (int i = 0; i < TRIM_BLOCKS; i++) {
+        blocks[i] = Malloc(64 << 10);
+        memset(blocks[i], 1, 64 << 10);
+    }
+    struct malloc_stats grown, freed, trimmed;
+    MallocStats(&grown);
+    for (int i = TRIM_BLOCKS - 1; i >= 0; i--) {
+        Free(blocks[i]);
+    }
+    MallocStats(&freed);
+    assert(freed.heap_bytes < grown.heap_bytes - (8 << 20));
+    assert(freed.largest_free_block >= TRIM_PAD);
+    uint64_t rss = rss_bytes();
+    assert(Trim() == 1);
+    MallocStats(&trimmed);
+    assert(trimmed.heap_bytes <= freed.heap_bytes - TRIM_PAD);
+    assert(rss_bytes() < rss - (1 << 20));
+}
+
+static void test_trim() {
+    expect_pass(trim_heap);
+}
+
+/* With a decay time, Free keeps the pages of large blocks and empty slab runs,
+ * and the decay thread releases them once they have aged */
+static void decay_release() {
+    static void* slots[100000];
+    assert(Mallopt(MALLOC_OPT_DECAY_TIME, DECAY_TEST_TIME) == 0);
+    assert(Mallopt(MALLOC_OPT_TCACHE_MAX, 0) == 0);
+    void* blocks[32];
+    for (int i = 0; i < 32; i++) {
+        blocks[i] = Malloc(120 << 10);
+        memset(blocks[i], 1, 120 << 10);
+    }
+    // Keeps the blocks off the tail, which is trimmed rather than purged
+    Malloc(1000);
+    for (int i = 0; i < 100000; i++) {
+        slots[i] = Malloc(64);
+        memset(slots[i], 1, 64);
+    }
+    uint64_t rss = rss_bytes();
+    for (int i = 0; i < 32; i++) {
+        Free(blocks[i]);
+    }
+    for (int i = 0; i < 100000; i++) {
+        Free(slots[i]);
+    }
+    assert(rss_bytes() > rss - (2 << 20));
+    for (int wait = 0; wait < 100 && rss_bytes() > rss - (8 << 20); wait++) {
+        usleep(DECAY_TEST_TIME * 1000 / 4);
+    }
+    assert(rss_bytes() <= rss - (8 << 20));
+}
+
+static void test_decay() {
+    expect_pass(decay_release);
+}
+
+/* A main heap whose break is moved under it carries on in a mapped segment,
+ * and blocks on both sides of the move stay usable */
+static void stuck_heap_segment() {
+    Mallopt(MALLOC_OPT_MMAP_THRESHOLD, 1UL << 30);
+    char* old = Malloc(1000);
+    fill(old, 1000, 3);
+    sbrk(4096);
+    char* grown = Malloc(32 << 20);
+    assert(grown != NULL);
+    fill(grown, 32 << 20, 4);
+    assert(arena_of((struct block_header_t*)head_addr(grown))->segment != NULL);
+    assert(filled(old, 1000, 3) && filled(grown, 32 << 20, 4));
+    Free(old);
+    Free(grown);
+    Free(Malloc(1000));
+}
+
+static void test_segment_fallback() {
+    expect_pass(stuck_heap_segment);
+}
+
+#define HANDOFF_BLOCKS              4096
+
+static void* handoff[HANDOFF_BLOCKS];
+
+static void* handoff_producer(void* arg) {
+    (void)arg;
+    for (unsigned int i = 0; i < HANDOFF_BLOCKS; i++) {
+        handoff[i] = Malloc(16 + i * 13 % 3000);
+        fill(handoff[i], 16, i);
+    }
+    return NULL;
+}
+
+/* Blocks freed by a thread other than the one that allocated them */
+static void test_threads() {
+    for (int round = 0; round < 4; round++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, handoff_producer, NULL);
+        pthread_join(thread, NULL);
+        for (unsigned int i = 0; i < HANDOFF_BLOCKS; i++) {
+            assert(filled(handoff[i], 16, i));
+            Free(handoff[i]);
+        }
+    }
+    struct malloc_stats stats;
+    MallocStats(&stats);
+    assert(stats.malloc_calls >= stats.free_calls);
+}
+
+static volatile int fork_churn_stop = 0;
+
+static void* fork_leaf(void* arg) {
+    (void)arg;
+    Free(Malloc(100));
+    return NULL;
+}
+
+static void* fork_churn(void* arg) {
+    (void)arg;
+    struct malloc_stats stats;
+    while (!fork_churn_stop) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, fork_leaf, NULL);
+        pthread_join(thread, NULL);
+        MallocStats(&stats);
+    }
+    return NULL;
+}
+
+static void fork_child_work() {
+    pthread_t thread;
+    pthread_create(&thread, NULL, fork_leaf, NULL);
+    pthread_join(thread, NULL);
+    Free(Malloc(50));
+    struct malloc_stats stats;
+    MallocStats(&stats);
+}
+
+/* A child forked while other threads hold allocator locks can still allocate */
+static void test_fork() {
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, fork_churn, NULL);
+    }
+    for (int i = 0; i < FORK_CHILDREN; i++) {
+        expect_pass(fork_child_work);
+    }
+    fork_churn_stop = 1;
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+#ifdef MALLOC_PROFILE
+#define PROFILE_TEST_SIZE           4099      /* odd size, so dumped samples of the test are told apart */
+
+/* Count the samples of PROFILE_TEST_SIZE bytes in a dump to a temporary file, checking its header */
+static uint64_t profile_test_samples() {
+    char path[] = "/tmp/malloc-test-profile-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    assert(MallocProfileDump(fd) == 0);
+    static char dump[1 << 20];
+    ssize_t length = pread(fd, dump, sizeof(dump) - 1, 0);
+    close(fd);
+    assert(length > 0);
+    dump[length] = '\0';
+    assert(strncmp(dump, "heap profile: ", 14) == 0 && strstr(dump, "@ heap_v2/") != NULL);
+    assert(strstr(dump, "\nMAPPED_LIBRARIES:\n") != NULL);
+    uint64_t samples = 0;
+    for (char* line = strstr(dump, "\n1: 4099 [1: 4099] @ 0x"); line != NULL; line = strstr(line + 1, "\n1: 4099 [1: 4099] @ 0x")) {
+        samples++;
+    }
+    return samples;
+}
+
+/* Sampled blocks show up in a dump with their stacks until they are freed */
+static void profile_sampled_blocks() {
+    static void* blocks[2000];
+    assert(Mallopt(MALLOC_OPT_PROFILE_INTERVAL, PROFILE_TEST_SIZE) == 0);
+    for (int i = 0; i < 2000; i++) {
+        blocks[i] = Malloc(PROFILE_TEST_SIZE);
+    }
+    assert(profile_test_samples() > 100);
+    for (int i = 0; i < 2000; i++) {
+        Free(blocks[i]);
+    }
+    assert(profile_test_samples() == 0);
+}
+
+static void test_profile() {
+    expect_pass(profile_sampled_blocks);
+}
+#endif
+
+#ifdef MALLOC_TRACE
+/* Return the index of the first record from start on with op, id, size and old, failing if there is none */
+static uint64_t trace_find(const struct malloc_trace_record* records, uint64_t count, uint64_t start,
+                           unsigned int op, void* id, uint64_t size, uint64_t old) {
+    for (uint64_t i = start; i < count; i++) {
+        if (records[i].op == op && records[i].id == (uintptr_t)id && records[i].size == size && records[i].old == old) {
+            return i;
+        }
+    }
+    assert(!"trace record missing");
+    return count;
+}
+
+/* Calls made while tracing are logged in order, and the replay tool matches every one of them */
+static void trace_replay() {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/malloc-test-%d.trace", getpid());
+    assert(MallocTraceStart(path) == 0);
+    char* ptr = Malloc(100);
+    char* zeroed = Calloc(3, 50);
+    char* aligned = Memalign(64, 200);
+    char* moved = Realloc(ptr, 3000);
+    Free(zeroed);
+    Free(aligned);
+    Free(moved);
+    MallocTraceStop();
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    static struct malloc_trace_record records[4096];
+    ssize_t length = read(fd, records, sizeof(records));
+    close(fd);
+    assert(length > 0 && length % sizeof(struct malloc_trace_record) == 0);
+    uint64_t count = length / sizeof(struct malloc_trace_record);
+    uint64_t at = trace_find(records, count, 0, MALLOC_TRACE_MALLOC, ptr, 100, 0);
+    at = trace_find(records, count, at + 1, MALLOC_TRACE_CALLOC, zeroed, 150, 0);
+    at = trace_find(records, count, at + 1, MALLOC_TRACE_MEMALIGN, aligned, 200, 64);
+    at = trace_find(records, count, at + 1, MALLOC_TRACE_REALLOC, moved, 3000, (uintptr_t)ptr);
+    at = trace_find(records, count, at + 1, MALLOC_TRACE_FREE, zeroed, 0, 0);
+    at = trace_find(records, count, at + 1, MALLOC_TRACE_FREE, aligned, 0, 0);
+    trace_find(records, count, at + 1, MALLOC_TRACE_FREE, moved, 0, 0);
+    // The tool runs in its own process, so it sees only what the file holds
+    char command[128];
+    snprintf(command, sizeof(command), "./replay %s", path);
+    FILE* replay = popen(command, "r");
+    assert(replay != NULL);
+    char output[4096];
+    size_t got = fread(output, 1, sizeof(output) - 1, replay);
+    output[got] = '\0';
+    assert(pclose(replay) == 0);
+    unlink(path);
+    assert(strstr(output, "unmatched           0\n") != NULL);
+    assert(strstr(output, "failed              0\n") != NULL);
+}
+
+static void test_trace() {
+    expect_pass(trace_replay);
+}
+#endif
+
+#ifdef MALLOC_HARDENED
+static void expect_abort(void (*test)(void)) {
+    int status = run_child(test, 1);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+static void* volatile victim;
+
+static void heap_double_free() {
+    victim = Malloc(1000);
+    Free(victim);
+    Free(victim);
+}
+
+static void slab_double_free() {
+    victim = Malloc(32);
+    Free(victim);
+    Free(victim);
+}
+
+static void heap_overflow() {
+    victim = Malloc(1000);
+    memset(victim, 0, MallocUsableSize(victim) + 1);
+    Free(victim);
+}
+
+static void mmap_overflow() {
+    victim = Malloc(1 << 20);
+    memset(victim, 0, MallocUsableSize(victim) + 1);
+    Free(victim);
+}
+
+/* Use after free writes over the links of a block in the free tree. Freeing
+ * the next block merges with it, which takes it out of the tree. A batch is
+ * carved from one free block, so its blocks are adjacent */
+static void tree_use_after_free() {
+    void* blocks[4];
+    assert(MallocBatch(5000, 4, blocks) == 4);
+    victim = blocks[1];
+    Free(victim);
+    memset(victim, 'A', 40);
+    Free(blocks[2]);
+    Trim();
+}
+
+/* Two bin sized blocks merge into one large enough for the tree. Trim merges
+ * them before the write even when fastbins defer it */
+static void merged_tree_use_after_free() {
+    void* blocks[5];
+    assert(MallocBatch(500, 5, blocks) == 5);
+    victim = blocks[1];
+    Free(victim);
+    Free(blocks[2]);
+    Trim();
+    memset(victim, 'A', 40);
+    Free(blocks[3]);
+    Trim();
+}
+
+static void test_hardened() {
+    expect_abort(heap_double_free);
+    expect_abort(slab_double_free);
+    expect_abort(heap_overflow);
+    expect_abort(mmap_overflow);
+    expect_abort(tree_use_after_free);
+    expect_abort(merged_tree_use_after_free);
+}
+#endif
+
+#define TEST(name)                  { #name, name }
+
+static const struct {
+    const char*                     name;
+    void                            (*run)(void);
+} tests[] = {
+    TEST(test_blocks),
+    TEST(test_malloc),
+    TEST(test_calloc),
+    TEST(test_memalign),
+    TEST(test_realloc),
+    TEST(test_realloc_stuck_heap),
+    TEST(test_free_sized),
+    TEST(test_usable_size),
+    TEST(test_batch),
+    TEST(test_region),
+    TEST(test_heap_walk),
+    TEST(test_stats),
+    TEST(test_mallopt),
+    TEST(test_trim),
+    TEST(test_decay),
+    TEST(test_segment_fallback),
+    TEST(test_threads),
+    TEST(test_fork),
+#ifdef MALLOC_PROFILE
+    TEST(test_profile),
+#endif
+#ifdef MALLOC_TRACE
+    TEST(test_trace),
+#endif
+#ifdef MALLOC_HARDENED
+    TEST(test_hardened),
+#endif
+};
+
+int main() {
+    for (unsigned int i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        printf("%-28s", tests[i].name);
+        fflush(stdout);
+        tests[i].run();
+        printf("ok\n");
+    }
+    return 0;
+}